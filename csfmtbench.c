@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2013 - Adrien Vergé <adrienverge@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcsfmt.h"
+
+#define FIRST_ID	0x10
+
+void usage(char *prog)
+{
+	printf("usage: %s [-n BYTES] [-c SOURCES] [-l MAX_RUN] [-r RUNS] "
+	       "[-S SEED]\n"
+	       "Encodes the trace of several sources into CoreSight frames, "
+	       "then measures\nthe deformatter on them.\n", prog);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Byte by byte deformatter, straight from the frame format, to compare
+ * with
+ */
+static void ref_deformat(const uint8_t *frames, size_t size, char **out,
+			 size_t *len)
+{
+	const uint8_t *f;
+	int id = -1, next, k, delayed;
+	uint8_t b;
+
+	for (f = frames; f + CSFMT_FRAME_SIZE <= frames + size;
+	     f += CSFMT_FRAME_SIZE) {
+		next = -1;
+		for (k = 0; k < CSFMT_FRAME_SIZE - 1; k++) {
+			if (k % 2 == 0 && (f[k] & 1)) {
+				delayed = f[15] >> (k / 2) & 1;
+				if (delayed && k < CSFMT_FRAME_SIZE - 2)
+					next = f[k] >> 1;
+				else
+					id = f[k] >> 1;
+				continue;
+			}
+			b = k % 2 ? f[k] : f[k] | (f[15] >> (k / 2) & 1);
+			if (id > CSFMT_ID_NULL && id < CSFMT_ID_RESERVED)
+				out[id][len[id]++] = b;
+			if (next >= 0) {
+				id = next;
+				next = -1;
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int ret = EXIT_FAILURE;
+	int c, r, runs = 5, sources = 4, id;
+	size_t size = 16 << 20, max_run = 64, run, k, n, flen = 0;
+	uint8_t *data, *frames;
+	char *expect[CSFMT_IDS] = { NULL }, *out[CSFMT_IDS] = { NULL };
+	size_t expect_len[CSFMT_IDS] = { 0 }, out_len[CSFMT_IDS];
+	struct csfmt_encoder_t enc;
+	struct csfmt_decoder_t dec;
+	double start, t, best_ref = 1e9, best = 1e9;
+
+	srand(1);
+
+	while ((c = getopt(argc, argv, "hn:c:l:r:S:")) != -1)
+		switch (c) {
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'n':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			sources = atoi(optarg);
+			break;
+		case 'l':
+			max_run = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'S':
+			srand(atoi(optarg));
+			break;
+		case '?':
+		default:
+			usage(argv[0]);
+			goto end;
+		}
+
+	if (optind != argc || size == 0 || sources < 1 ||
+	    FIRST_ID + sources > CSFMT_ID_RESERVED || max_run < 1 || runs < 1) {
+		usage(argv[0]);
+		goto end;
+	}
+
+	/*
+	 * Runs of random length from random sources
+	 */
+	data = malloc(size);
+	frames = malloc(CSFMT_ENCODE_MAX(size) + size + CSFMT_FRAME_SIZE);
+	for (id = FIRST_ID; id < FIRST_ID + sources; id++) {
+		expect[id] = malloc(size);
+		out[id] = malloc(size);
+		if (expect[id] == NULL || out[id] == NULL)
+			data = NULL;
+	}
+	if (data == NULL || frames == NULL) {
+		perror("malloc");
+		goto free_bufs;
+	}
+	for (k = 0; k < size; k++)
+		data[k] = rand();
+
+	csfmt_encoder_init(&enc);
+	for (k = 0; k < size; k += run) {
+		id = FIRST_ID + rand() % sources;
+		run = 1 + rand() % max_run;
+		if (run > size - k)
+			run = size - k;
+		flen += csfmt_encode(&enc, id, data + k, run, frames + flen);
+		memcpy(expect[id] + expect_len[id], data + k, run);
+		expect_len[id] += run;
+	}
+	flen += csfmt_encode_flush(&enc, frames + flen);
+
+	printf("%zu bytes from %d sources, runs of 1 to %zu bytes, "
+	       "%zu frames\n", size, sources, max_run, flen / CSFMT_FRAME_SIZE);
+
+	for (r = 0; r < runs; r++) {
+		memset(out_len, 0, sizeof(out_len));
+		start = now();
+		ref_deformat(frames, flen, out, out_len);
+		t = now() - start;
+		if (t < best_ref)
+			best_ref = t;
+	}
+	for (id = FIRST_ID; id < FIRST_ID + sources; id++)
+		if (out_len[id] != expect_len[id] ||
+		    memcmp(out[id], expect[id], out_len[id]) != 0)
+			fprintf(stderr, "warning: reference differs for ID "
+				"0x%02x\n", id);
+
+	for (r = 0; r < runs; r++) {
+		csfmt_decoder_init(&dec);
+		start = now();
+		/* in ETB drain sized pieces, not frame aligned */
+		for (k = 0; k < flen; k += n) {
+			n = flen - k < 8188 ? flen - k : 8188;
+			if (csfmt_decoder_feed(&dec, frames + k, n)) {
+				fprintf(stderr, "error: out of memory\n");
+				goto free_bufs;
+			}
+		}
+		t = now() - start;
+		if (t < best)
+			best = t;
+		for (id = FIRST_ID; id < FIRST_ID + sources; id++)
+			if (dec.streams[id].len != expect_len[id] ||
+			    memcmp(dec.streams[id].buf, expect[id],
+				   expect_len[id]) != 0)
+				fprintf(stderr, "warning: csfmt_decoder_feed "
+					"differs for ID 0x%02x\n", id);
+		csfmt_decoder_destroy(&dec);
+	}
+
+	printf("%-20s %9.1f MB/s\n", "byte by byte", flen / best_ref / 1e6);
+	printf("%-20s %9.1f MB/s\n", "csfmt_decoder_feed", flen / best / 1e6);
+	ret = EXIT_SUCCESS;
+
+free_bufs:
+	for (id = 0; id < CSFMT_IDS; id++) {
+		free(expect[id]);
+		free(out[id]);
+	}
+	free(data);
+	free(frames);
+end:
+	exit(ret);
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2013 - Adrien Vergé <adrienverge@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libomap4430.h"
+#include "libetb.h"
+
+void usage(char *prog)
+{
+	printf("usage: %s [-s BYTES] [-r RUNS]\n"
+	       "Loads the ETB RAM, then measures how long etb_retrieve() takes\n"
+	       "to drain it, with word reads and with burst reads.\n", prog);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Each run drains size bytes, loaded after resetting the pointers.  Returns
+ * the best time, or a negative value on error.
+ */
+static double bench(struct etb_handle_t *etb_handle, uint32_t *ref,
+		    uint32_t *buf, size_t size, int runs)
+{
+	double start, t, best = 1e9;
+	ssize_t n;
+	int r;
+
+	for (r = 0; r < runs; r++) {
+		if (etb_enable(etb_handle) || etb_disable(etb_handle))
+			return -1;
+		if (etb_load(etb_handle, ref, size) != size)
+			return -1;
+
+		memset(buf, 0, size);
+		start = now();
+		n = etb_retrieve(etb_handle, buf, size);
+		t = now() - start;
+
+		if (n != size || memcmp(buf, ref, size) != 0) {
+			fprintf(stderr, "error: data read differs from data "
+				"loaded\n");
+			return -1;
+		}
+		if (t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+static void report(const char *name, double secs, size_t size)
+{
+	printf("%-6s %9.2f us per KB\n", name, secs * 1e6 / (size / 1024.));
+}
+
+int main(int argc, char **argv)
+{
+	int ret = EXIT_FAILURE;
+	int c;
+	int runs = 100;
+	size_t size = 4096, k;
+	uint32_t *ref, *buf;
+	double t;
+	int burst;
+	struct etb_handle_t etb_handle = { .base = NULL };
+
+	while ((c = getopt(argc, argv, "hs:r:")) != -1)
+		switch (c) {
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case '?':
+		default:
+			usage(argv[0]);
+			goto end;
+		}
+
+	size -= size % 4;
+	if (optind != argc || size == 0 || runs < 1) {
+		usage(argv[0]);
+		goto end;
+	}
+
+	ref = malloc(size);
+	buf = malloc(size);
+	if (ref == NULL || buf == NULL) {
+		perror("malloc");
+		goto free_bufs;
+	}
+	for (k = 0; k < size / 4; k++)
+		ref[k] = 0x9e3779b9 * (k + 1);
+
+	if (omap4430_enable_emu()) {
+		printf("error: couldn't enable OMAP4430 EMU clocks\n");
+		goto free_bufs;
+	}
+	if (etb_open(&etb_handle)) {
+		printf("error: couldn't open ETB\n");
+		goto free_bufs;
+	}
+
+	printf("draining %zu bytes, best of %d runs\n", size, runs);
+	etb_begin(&etb_handle);
+
+	burst = etb_handle.burst;
+	etb_handle.burst = 0;
+	t = bench(&etb_handle, ref, buf, size, runs);
+	if (t < 0)
+		goto close_etb;
+	report("RRD", t, size);
+
+	if (burst) {
+		etb_handle.burst = 1;
+		t = bench(&etb_handle, ref, buf, size, runs);
+		if (t < 0)
+			goto close_etb;
+		report("RBD", t, size);
+	} else {
+		printf("RBD    not available\n");
+	}
+
+	ret = EXIT_SUCCESS;
+	etb_end(&etb_handle);
+	omap4430_op_report(stdout);
+
+close_etb:
+	etb_close(&etb_handle);
+free_bufs:
+	free(ref);
+	free(buf);
+end:
+	exit(ret);
+}
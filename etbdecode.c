@@ -17,18 +17,20 @@
 
 #include <signal.h>
 #include <signal.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "libomap4430.h"
+#include "libcsfmt.h"
 #include "libetb.h"
 #include "libstm.h"
 #include "libstp.h"
 
-#define BUFSIZE 512
+#define RING_SLOTS	16	/* power of two */
 
-static int keep_going;
+static volatile sig_atomic_t keep_going;
 
 static void catch_exit(int sig)
 {
@@ -36,20 +38,305 @@ static void catch_exit(int sig)
 	signal(SIGINT, SIG_DFL);
 }
 
+/*
+ * Single-producer single-consumer ring between the capture thread, which
+ * only drains the ETB, and the decode thread.  Each slot holds one drain.
+ * head and tail count slots from the start, and each is only written by
+ * one thread: a slot is handed over by the store to head or tail that
+ * follows its use.
+ */
+struct slot_t {
+	char *data;		/* room for the whole RAM */
+	ssize_t len;
+	uint32_t start;		/* RAM word of the first one */
+	int gap;		/* words were lost before these */
+};
+
+struct ring_t {
+	struct slot_t slots[RING_SLOTS];
+	unsigned int head;	/* next slot to fill */
+	unsigned int tail;	/* next slot to decode */
+	int done;		/* no more slots will be filled */
+
+	/* Only used by the capture thread */
+	char *scratch;		/* for the words dropped */
+	int gap;		/* words were dropped since the last slot */
+	uint64_t lost;		/* etb_handle->lost when last seen */
+	uint64_t suspects;	/* etb_handle->suspects when last seen */
+	unsigned int high;	/* most slots filled at once */
+	unsigned long stalls;	/* drains put off because the ring was full */
+	uint64_t dropped;	/* words drained while it was full */
+};
+
+struct decode_t {
+	struct ring_t *ring;
+	struct stp_decoder_t *decoder;
+	struct stp_arena_t *arena;
+
+	/* With the formatter, see deformat() */
+	struct csfmt_decoder_t *fmt;
+	int stm_id;
+	const char *raw_prefix;
+	FILE *raw[CSFMT_IDS];
+};
+
+static int ring_init(struct ring_t *ring, size_t size)
+{
+	int i;
+
+	memset(ring, 0, sizeof(*ring));
+	for (i = 0; i < RING_SLOTS; i++) {
+		ring->slots[i].data = malloc(size);
+		if (ring->slots[i].data == NULL)
+			return -1;
+	}
+	ring->scratch = malloc(size);
+
+	return ring->scratch == NULL ? -1 : 0;
+}
+
+static void ring_destroy(struct ring_t *ring)
+{
+	int i;
+
+	for (i = 0; i < RING_SLOTS; i++)
+		free(ring->slots[i].data);
+	free(ring->scratch);
+}
+
+static int ring_full(struct ring_t *ring)
+{
+	return ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+	       RING_SLOTS;
+}
+
+/*
+ * Flags a gap before the next slot if the last drain lost words, or may
+ * have, whatever it returned
+ */
+static void ring_check_gap(struct etb_handle_t *etb_handle,
+			   struct ring_t *ring)
+{
+	if (etb_handle->lost != ring->lost ||
+	    etb_handle->suspects != ring->suspects) {
+		ring->lost = etb_handle->lost;
+		ring->suspects = etb_handle->suspects;
+		ring->gap = 1;
+	}
+}
+
+/*
+ * Drains what was written to the ETB since the previous call into the next
+ * slot, which must be free.  Returns the number of bytes read.
+ */
+static ssize_t capture(struct etb_handle_t *etb_handle, struct ring_t *ring)
+{
+	unsigned int head = ring->head;
+	struct slot_t *slot = &ring->slots[head % RING_SLOTS];
+	unsigned int used;
+
+	slot->len = etb_drain(etb_handle, slot->data, 4 * etb_handle->depth);
+	ring_check_gap(etb_handle, ring);
+	if (slot->len <= 0)
+		return slot->len;
+	slot->start = etb_handle->first;
+	slot->gap = ring->gap;
+	ring->gap = 0;
+
+	used = head + 1 - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (used > ring->high)
+		ring->high = used;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return slot->len;
+}
+
+/*
+ * Called instead of capture() when the ring is full.  The ETB keeps the
+ * words until it is three quarters full, then they are dropped, so that
+ * they are counted rather than overwritten unnoticed.
+ */
+static void stall(struct etb_handle_t *etb_handle, struct ring_t *ring)
+{
+	ssize_t n;
+
+	ring->stalls++;
+	if (etb_fill(etb_handle) < etb_handle->depth / 4 * 3)
+		return;
+
+	n = etb_drain(etb_handle, ring->scratch, 4 * etb_handle->depth);
+	if (n > 0) {
+		ring->dropped += n / 4;
+		ring->gap = 1;
+	}
+	ring_check_gap(etb_handle, ring);
+}
+
+/*
+ * Decodes STP and outputs the packets.  Messages split across two calls are
+ * kept until the next one.  The data is copied into the decoder: unlike
+ * stp_decoder_space(), a slot can be filled while the decoder is in use.
+ */
+static void decode_stp(struct decode_t *d, char *buf, size_t len)
+{
+	struct stp_pkt *pkt_list, *pkt;
+
+	pkt_list = stp_decoder_feed(d->decoder, buf, len);
+	for (pkt = pkt_list; pkt != NULL; pkt = pkt->next)
+		write(STDOUT_FILENO, pkt->data, pkt->len);
+	stp_arena_reset(d->arena);
+}
+
+/* Saves the data of a source other than the STM to its own file */
+static void save_raw(struct decode_t *d, int id, struct csfmt_stream_t *s)
+{
+	char path[256];
+
+	if (d->raw_prefix == NULL)
+		return;
+
+	if (d->raw[id] == NULL) {
+		snprintf(path, sizeof(path), "%s-%02x.bin", d->raw_prefix, id);
+		d->raw[id] = fopen(path, "w");
+		if (d->raw[id] == NULL) {
+			perror(path);
+			d->raw_prefix = NULL;
+			return;
+		}
+	}
+	fwrite(s->buf, 1, s->len, d->raw[id]);
+}
+
+/*
+ * With the formatter, splits a slot of frames among the ATB sources: STP
+ * is decoded from the STM one, the others are saved raw.
+ */
+static void deformat(struct decode_t *d, struct slot_t *slot)
+{
+	struct csfmt_stream_t *s;
+	int id;
+
+	/* Frames are 4 words, from RAM word 0 on */
+	if (slot->gap)
+		csfmt_decoder_gap(d->fmt, (4 - slot->start % 4) % 4 * 4);
+	if (csfmt_decoder_feed(d->fmt, slot->data, slot->len)) {
+		fprintf(stderr, "error: couldn't deformat ETB frames\n");
+		return;
+	}
+
+	for (id = 0; id < CSFMT_IDS; id++) {
+		s = &d->fmt->streams[id];
+		if (s->len == 0)
+			continue;
+		if (id == d->stm_id)
+			decode_stp(d, s->buf, s->len);
+		else
+			save_raw(d, id, s);
+		s->len = 0;
+	}
+}
+
+/*
+ * Decode thread: decodes and outputs the slots in order, until the capture
+ * thread is done.  Packets of each slot are released at once.
+ */
+static void *decode(void *arg)
+{
+	struct decode_t *d = arg;
+	struct ring_t *ring = d->ring;
+	struct stp_pkt *pkt_list, *pkt;
+	struct slot_t *slot;
+	unsigned int tail = ring->tail;
+	unsigned int idle_us = ETB_SCHED_MIN_US;
+	int done;
+
+	for (;;) {
+		/* done first: once set, head is final */
+		done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+		if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			if (done)
+				break;
+			/* Backs off while the ring stays empty */
+			usleep(idle_us);
+			if (idle_us < ETB_SCHED_MAX_US)
+				idle_us *= 2;
+			continue;
+		}
+		idle_us = ETB_SCHED_MIN_US;
+
+		slot = &ring->slots[tail % RING_SLOTS];
+		if (slot->gap)
+			stp_decoder_gap(d->decoder);
+		if (d->fmt != NULL)
+			deformat(d, slot);
+		else
+			decode_stp(d, slot->data, slot->len);
+
+		__atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+	}
+
+	pkt_list = stp_decoder_flush(d->decoder);
+	for (pkt = pkt_list; pkt != NULL; pkt = pkt->next)
+		write(STDOUT_FILENO, pkt->data, pkt->len);
+
+	return NULL;
+}
+
 int main(int argc, char **argv)
 {
 	int ret = -1;
-	char buf[BUFSIZE];
-	ssize_t n;
 	int nowait = 0;
+	int i;
 	struct etb_handle_t etb_handle = { .base = NULL };
+	struct etb_sched_t sched;
+	struct ring_t ring;
+	struct decode_t d;
+	pthread_t decoder_thread;
+	sigset_t sigint;
+	int stats = 0;
+	struct stp_decoder_t decoder;
+	struct stp_arena_t arena;
+	struct stp_filter_t filter;
+	struct stp_filter_t *pfilter = NULL;
+	struct csfmt_decoder_t fmt;
+	int stm_id = -1;
+	char *raw_prefix = NULL;
+	char *endptr;
 
 	/*
 	 * Parse args
 	 */
-	if (argc >= 2)
-		if (strcmp("--nowait", argv[1]) == 0)
+	stp_filter_init(&filter);
+	for (i = 1; i < argc; i++) {
+		if (strcmp("--nowait", argv[i]) == 0) {
 			nowait = 1;
+		} else if (strcmp("--stats", argv[i]) == 0) {
+			stats = 1;
+		} else if (strcmp("-C", argv[i]) == 0 && i + 1 < argc) {
+			/* only decode these channels, e.g. 10,11,40-47 */
+			if (stp_filter_parse(&filter, argv[++i])) {
+				printf("error: invalid channel list '%s'\n",
+				       argv[i]);
+				goto end;
+			}
+			pfilter = &filter;
+		} else if (strcmp("-F", argv[i]) == 0 && i + 1 < argc) {
+			/* capture in formatter mode, the STM having this ID */
+			stm_id = strtol(argv[++i], &endptr, 0);
+			if (*endptr != '\0' || stm_id <= CSFMT_ID_NULL ||
+			    stm_id >= CSFMT_ID_RESERVED) {
+				printf("error: invalid ATB ID '%s'\n", argv[i]);
+				goto end;
+			}
+		} else if (strcmp("-R", argv[i]) == 0 && i + 1 < argc) {
+			/* save the other sources to PREFIX-ID.bin */
+			raw_prefix = argv[++i];
+		} else {
+			printf("usage: %s [--nowait] [--stats] [-C CHANNELS]\n"
+			       "       [-F STM_ATB_ID [-R PREFIX]]\n", argv[0]);
+			goto end;
+		}
+	}
 
 	/*
 	 * Enable clocks
@@ -66,50 +353,152 @@ int main(int argc, char **argv)
 		printf("error: couldn't open ETB\n");
 		goto end;
 	}
+	/* Unlocked once for the whole capture, rather than at each drain */
+	etb_begin(&etb_handle);
 
-	if (etb_enable(&etb_handle)) {
-		printf("error: couldn't enable ETB\n");
+	if (stp_decoder_init(&decoder)) {
+		printf("error: couldn't initialize STP decoder\n");
 		goto close_etb;
 	}
+	/* Packets of each slot are released at once, and the arena
+	 * memory is reused by the next one */
+	stp_arena_init(&arena, 0);
+	decoder.arena = &arena;
+	decoder.filter = pfilter;
+
+	memset(&d, 0, sizeof(d));
+	if (stm_id >= 0) {
+		/* The formatter may only be set while capture is off */
+		if (etb_disable(&etb_handle) ||
+		    etb_set_formatter(&etb_handle, 1)) {
+			printf("error: couldn't enable ETB formatter\n");
+			goto destroy_decoder;
+		}
+		if (csfmt_decoder_init(&fmt)) {
+			perror("malloc");
+			goto destroy_decoder;
+		}
+		d.fmt = &fmt;
+		d.stm_id = stm_id;
+		d.raw_prefix = raw_prefix;
+	}
+
+	if (ring_init(&ring, 4 * etb_handle.depth)) {
+		perror("malloc");
+		goto destroy_ring;
+	}
+
+	/*
+	 * Capture goes on while the ETB is drained
+	 */
+	if (etb_start(&etb_handle)) {
+		printf("error: couldn't enable ETB\n");
+		goto destroy_ring;
+	}
+
+	/*
+	 * Decoding and output go on in their own thread, so that a slow output
+	 * does not delay the drains.  SIGINT is left to this one.
+	 */
+	d.ring = &ring;
+	d.decoder = &decoder;
+	d.arena = &arena;
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint, NULL);
+	if (pthread_create(&decoder_thread, NULL, decode, &d)) {
+		printf("error: couldn't start decode thread\n");
+		goto destroy_ring;
+	}
+	pthread_sigmask(SIG_UNBLOCK, &sigint, NULL);
 
 	/*
 	 * Ok, now let's wait for data coming in the ETB
 	 */
+	etb_sched_init(&sched, &etb_handle, ETB_SCHED_MIN_US, ETB_SCHED_MAX_US);
 	keep_going = 1;
 	signal(SIGINT, catch_exit);
 	//etb_status();
 	while (keep_going) {
-		// Possible de lire ETB sans désactiver l'écriture dedans ?
-		etb_disable(&etb_handle);
-		n = etb_retrieve(&etb_handle, buf, BUFSIZE);
-		//printf("n = %d\n", n);
-		etb_enable(&etb_handle);
-
-		if (n < 0)
-			printf("error: etb_retrieve returned -1\n");
-		else if (n > 0) {
-			struct stp_pkt *pkt_list, *pkt;
-
-			//pkt_list = stp_read_pkts(buf, n);
-			//printf("retrieved 0x%x bytes from ETB\n", n);
-			pkt_list = stp_read_pkts_in_raw_etb(buf, n);
-
-			for (pkt = pkt_list; pkt != NULL; pkt = pkt->next)
-				write(STDOUT_FILENO, pkt->data, pkt->len);
-
-			if (pkt_list != NULL)
-				free_stp_pkt_list(pkt_list);
-		}
+		if (ring_full(&ring))
+			stall(&etb_handle, &ring);
+		else
+			capture(&etb_handle, &ring);
 
-		if (nowait)
+		if (nowait || !keep_going)
 			break;
 
-		sleep(1);
+		/* Returns early when interrupted, to stop at once */
+		etb_sched_wait(&sched, &etb_handle, &keep_going);
 	}
 
 	ret = 0;
 
 	etb_disable(&etb_handle);
+	for (;;) {
+		if (ring_full(&ring)) {
+			usleep(ETB_SCHED_MIN_US);
+			continue;
+		}
+		if (capture(&etb_handle, &ring) <= 0)
+			break;
+	}
+	__atomic_store_n(&ring.done, 1, __ATOMIC_RELEASE);
+	pthread_join(decoder_thread, NULL);
+
+	etb_end(&etb_handle);
+
+	if (stats) {
+		etb_sched_report(&sched, &etb_handle);
+		omap4430_op_report(stderr);
+		fprintf(stderr, "ring: high-water mark %u of %d slots, "
+			"%lu stalls, %llu words dropped\n", ring.high,
+			RING_SLOTS, ring.stalls,
+			(unsigned long long) ring.dropped);
+		fprintf(stderr, "decoder: %llu blocks without a sync packet, "
+			"%llu bytes dropped\n",
+			(unsigned long long) decoder.cuts,
+			(unsigned long long) decoder.dropped);
+		if (d.fmt != NULL) {
+			fprintf(stderr, "formatter: %llu frames, %llu bytes of "
+				"unknown source\n",
+				(unsigned long long) fmt.frames,
+				(unsigned long long) fmt.unknown.total);
+			for (i = 0; i < CSFMT_IDS; i++)
+				if (fmt.streams[i].total > 0)
+					fprintf(stderr, "  ID 0x%02x: %llu bytes\n",
+						i, (unsigned long long)
+						fmt.streams[i].total);
+		}
+	} else {
+		if (etb_handle.lost > 0)
+			fprintf(stderr, "warning: at least %llu words overwritten "
+				"before they were read, in %llu overruns\n",
+				(unsigned long long) etb_handle.lost,
+				(unsigned long long) etb_handle.overruns);
+		if (etb_handle.suspects > 0)
+			fprintf(stderr, "warning: %llu drains may have missed "
+				"whole turns of the RAM\n",
+				(unsigned long long) etb_handle.suspects);
+		if (ring.dropped > 0)
+			fprintf(stderr, "warning: %llu words dropped, output "
+				"too slow\n", (unsigned long long) ring.dropped);
+		if (decoder.cuts > 0)
+			fprintf(stderr, "warning: %llu bytes dropped, in %llu "
+				"blocks without a sync packet\n",
+				(unsigned long long) decoder.dropped,
+				(unsigned long long) decoder.cuts);
+	}
+destroy_ring:
+	ring_destroy(&ring);
+	for (i = 0; i < CSFMT_IDS; i++)
+		if (d.raw[i] != NULL)
+			fclose(d.raw[i]);
+	if (d.fmt != NULL)
+		csfmt_decoder_destroy(d.fmt);
+destroy_decoder:
+	stp_decoder_destroy(&decoder);
+	stp_arena_destroy(&arena);
 close_etb:
 	etb_close(&etb_handle);
 end:
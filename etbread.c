@@ -25,12 +25,10 @@
 #include "libetb.h"
 #include "libstm.h"
 
-#define BUFSIZE 512
-
 #define halfbyte(src, pos) \
 	(((pos)%2)?((src[(pos)/2]>>4)&0xf):(src[(pos)/2]&0xf))
 
-static int keep_going;
+static volatile sig_atomic_t keep_going;
 
 static void catch_exit(int sig)
 {
@@ -38,23 +36,41 @@ static void catch_exit(int sig)
 	signal(SIGINT, SIG_DFL);
 }
 
+static void output(char *buf, ssize_t n, int output_debug)
+{
+	off_t i;
+
+	if (output_debug) {
+		for (i = 0; i < 2 * n; i++) {
+			printf("%x ", halfbyte(buf, i));
+		}
+		printf("\n");
+	} else
+		write(STDOUT_FILENO, buf, n);
+}
+
 int main(int argc, char **argv)
 {
 	int ret = -1;
-	char buf[BUFSIZE];
+	char *buf;
 	ssize_t n;
 	int nowait = 0;
+	int i;
 	struct etb_handle_t etb_handle = { .base = NULL };
+	struct etb_sched_t sched;
+	int stats = 0;
 	int output_debug = 0;
 
 	/*
 	 * Parse args
 	 */
-	if (argc >= 2) {
-		if (strcmp("--nowait", argv[1]) == 0)
+	for (i = 1; i < argc; i++) {
+		if (strcmp("--nowait", argv[i]) == 0)
 			nowait = 1;
-		else if (strcmp("--dbg", argv[1]) == 0)
+		else if (strcmp("--dbg", argv[i]) == 0)
 			output_debug = 1;
+		else if (strcmp("--stats", argv[i]) == 0)
+			stats = 1;
 	}
 
 	/*
@@ -72,49 +88,73 @@ int main(int argc, char **argv)
 		printf("error: couldn't open ETB\n");
 		goto end;
 	}
+	/* Unlocked once for the whole capture, rather than at each drain */
+	etb_begin(&etb_handle);
 
-	if (etb_enable(&etb_handle)) {
-		printf("error: couldn't enable ETB\n");
+	/* Room for the whole RAM */
+	buf = malloc(4 * etb_handle.depth);
+	if (buf == NULL) {
+		perror("malloc");
 		goto close_etb;
 	}
 
+	/*
+	 * Capture goes on while the ETB is drained
+	 */
+	if (etb_start(&etb_handle)) {
+		printf("error: couldn't enable ETB\n");
+		goto free_buf;
+	}
+
 	/*
 	 * Ok, now let's wait for data coming in the ETB
 	 */
+	etb_sched_init(&sched, &etb_handle, ETB_SCHED_MIN_US, ETB_SCHED_MAX_US);
 	keep_going = 1;
 	signal(SIGINT, catch_exit);
 
 	//etb_status();
 
 	while (keep_going) {
-		// Possible de lire ETB sans désactiver l'écriture dedans ?
-		etb_disable(&etb_handle);
-		n = etb_retrieve(&etb_handle, buf, BUFSIZE);
-		//fprintf(stderr, "n = %d\n", n);
-		etb_enable(&etb_handle);
+		n = etb_drain(&etb_handle, buf, 4 * etb_handle.depth);
 
 		if (n < 0)
-			fprintf(stderr, "error: etb_retrieve returned -1\n");
-		else if (n > 0) {
-			if (output_debug) {
-				off_t i;
-				for (i = 0; i < 2 * n; i++) {
-					printf("%x ", halfbyte(buf, i));
-				}
-				printf("\n");
-			} else
-				write(STDOUT_FILENO, buf, n);
-		}
+			fprintf(stderr, "error: etb_drain returned -1\n");
+		else if (n > 0)
+			output(buf, n, output_debug);
 
-		if (nowait)
+		if (nowait || !keep_going)
 			break;
 
-		sleep(1);
+		/* Returns early when interrupted, to stop at once */
+		etb_sched_wait(&sched, &etb_handle, &keep_going);
 	}
 
 	ret = 0;
 
 	etb_disable(&etb_handle);
+	while ((n = etb_drain(&etb_handle, buf, 4 * etb_handle.depth)) > 0)
+		output(buf, n, output_debug);
+
+	etb_end(&etb_handle);
+
+	if (stats) {
+		etb_sched_report(&sched, &etb_handle);
+		omap4430_op_report(stderr);
+	} else {
+		if (etb_handle.lost > 0)
+			fprintf(stderr, "warning: at least %llu words overwritten "
+				"before they were read, in %llu overruns\n",
+				(unsigned long long) etb_handle.lost,
+				(unsigned long long) etb_handle.overruns);
+		if (etb_handle.suspects > 0)
+			fprintf(stderr, "warning: %llu drains may have missed "
+				"whole turns of the RAM\n",
+				(unsigned long long) etb_handle.suspects);
+	}
+
+free_buf:
+	free(buf);
 close_etb:
 	etb_close(&etb_handle);
 end:
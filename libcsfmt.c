@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2013 - Adrien Vergé <adrienverge@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <signal.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcsfmt.h"
+
+/*
+ * Encoder
+ */
+
+void csfmt_encoder_init(struct csfmt_encoder_t *enc)
+{
+	memset(enc, 0, sizeof(*enc));
+	enc->id = -1;
+}
+
+/* Writes the frame to out once its 15 bytes are used */
+static size_t csfmt_put(struct csfmt_encoder_t *enc, uint8_t *out)
+{
+	if (enc->pos < CSFMT_FRAME_SIZE - 1)
+		return 0;
+
+	memcpy(out, enc->frame, CSFMT_FRAME_SIZE);
+	enc->frame[CSFMT_FRAME_SIZE - 1] = 0;
+	enc->pos = 0;
+
+	return CSFMT_FRAME_SIZE;
+}
+
+static size_t csfmt_encode_id(struct csfmt_encoder_t *enc, int id,
+			      uint8_t *out)
+{
+	uint8_t *flags = &enc->frame[CSFMT_FRAME_SIZE - 1];
+	int pos = enc->pos, k = pos / 2;
+	uint8_t data;
+
+	enc->id = id;
+
+	if (pos % 2 == 0) {
+		enc->frame[enc->pos++] = id << 1 | 1;
+		return csfmt_put(enc, out);
+	}
+
+	/* No data since the previous change: it is replaced */
+	if (enc->frame[pos - 1] & 1) {
+		enc->frame[pos - 1] = id << 1 | 1;
+		return 0;
+	}
+
+	/*
+	 * An ID change can only take an even byte: it takes the place of the
+	 * data byte before, which moves after it, and is delayed past it
+	 */
+	data = enc->frame[pos - 1] | (*flags >> k & 1);
+	enc->frame[pos - 1] = id << 1 | 1;
+	*flags |= 1 << k;
+	enc->frame[enc->pos++] = data;
+
+	return csfmt_put(enc, out);
+}
+
+/*
+ * Encodes size bytes of source id.  Frames are written to out as they are
+ * completed, the last one is kept until the next call.
+ * Returns the number of bytes written to out, at most
+ * CSFMT_ENCODE_MAX(size).
+ */
+size_t csfmt_encode(struct csfmt_encoder_t *enc, int id, const void *data,
+		    size_t size, void *out0)
+{
+	const uint8_t *p = data, *end = p + size;
+	uint8_t *out = out0;
+	size_t n = 0;
+
+	if (size > 0 && id != enc->id)
+		n += csfmt_encode_id(enc, id, out);
+
+	for (; p < end; p++) {
+		if (enc->pos % 2 == 0) {
+			enc->frame[enc->pos] = *p & 0xfe;
+			enc->frame[CSFMT_FRAME_SIZE - 1] |=
+				(*p & 1) << (enc->pos / 2);
+		} else {
+			enc->frame[enc->pos] = *p;
+		}
+		enc->pos++;
+		n += csfmt_put(enc, out + n);
+	}
+
+	return n;
+}
+
+/*
+ * Completes the current frame, if any, with padding.  Returns the number of
+ * bytes written to out, 0 or CSFMT_FRAME_SIZE.
+ */
+size_t csfmt_encode_flush(struct csfmt_encoder_t *enc, void *out)
+{
+	uint8_t zero = 0;
+	size_t n = 0;
+
+	if (enc->pos == 0)
+		return 0;
+
+	if (enc->id != CSFMT_ID_NULL)
+		n = csfmt_encode_id(enc, CSFMT_ID_NULL, out);
+	while (n == 0)
+		n = csfmt_encode(enc, CSFMT_ID_NULL, &zero, 1, out);
+
+	return n;
+}
+
+/*
+ * Decoder
+ *
+ * A frame is read as two little-endian 64-bit halves.  Bit 0 of the even
+ * bytes are at bits 0, 16, 32 and 48 of each half: for each value of byte
+ * 15, csfmt_lsb gives the data bits that replace them.
+ *
+ * The ID changes among the 8 even bytes, and which of them are delayed
+ * (their bit of byte 15), split the 15 bytes into segments of one source
+ * each: for each of the 3^8 combinations, csfmt_segs gives where they
+ * start and their length.  A delayed change adds the byte after it to the
+ * segment before; that byte is written after the segment whether there is
+ * one or not, and counted if there is.  Each segment is copied with one
+ * fixed 16-byte store, the streams having room for it.
+ */
+
+#define CSFMT_EVEN_LSB	0x0001000100010001ULL
+
+static uint64_t csfmt_lsb[2][256];
+
+static struct {
+	uint8_t count;
+	uint8_t k[8];		/* ID change in byte 2k */
+} csfmt_ids[256];
+
+struct csfmt_segs_t {
+	uint8_t count;		/* ID changes */
+	uint8_t delayed;	/* bit i: segment i takes the byte after */
+	uint8_t id[8];		/* byte of change i */
+	uint8_t seg[9];		/* start in bits 3:0, length in bits 7:4 */
+};
+
+static struct csfmt_segs_t csfmt_segs[6561];
+static uint16_t csfmt_segs_base[256];	/* entries of ID changes v */
+static uint8_t csfmt_pext4[16][16];	/* bits of v where m is set */
+
+static pthread_once_t csfmt_tables_once = PTHREAD_ONCE_INIT;
+
+static void csfmt_init_segs(struct csfmt_segs_t *e, int ids, int delayed)
+{
+	int i, k, p = 0, x;
+
+	for (i = 0; i < csfmt_ids[ids].count; i++) {
+		k = csfmt_ids[ids].k[i];
+		/* The last byte is byte 15: nothing to delay */
+		x = (delayed >> i & 1) && 2 * k + 1 < CSFMT_FRAME_SIZE - 1;
+		e->seg[i] = p | (2 * k - p) << 4;
+		e->id[i] = 2 * k;
+		e->delayed |= x << i;
+		p = 2 * k + 1 + x;
+	}
+	e->seg[i] = p | (CSFMT_FRAME_SIZE - 1 - p) << 4;
+	e->count = i;
+}
+
+static void csfmt_init_tables(void)
+{
+	int v, m, k, n, base = 0;
+
+	for (v = 0; v < 256; v++) {
+		for (k = 0; k < 4; k++) {
+			csfmt_lsb[0][v] |= (uint64_t) (v >> k & 1) << (16 * k);
+			csfmt_lsb[1][v] |=
+				(uint64_t) (v >> (k + 4) & 1) << (16 * k);
+		}
+		for (k = 0; k < 8; k++)
+			if (v >> k & 1)
+				csfmt_ids[v].k[csfmt_ids[v].count++] = k;
+	}
+
+	for (m = 0; m < 16; m++)
+		for (v = 0; v < 16; v++)
+			for (k = 0, n = 0; k < 4; k++)
+				if (m >> k & 1)
+					csfmt_pext4[m][v] |= (v >> k & 1) << n++;
+
+	for (v = 0; v < 256; v++) {
+		csfmt_segs_base[v] = base;
+		for (m = 0; m < 1 << csfmt_ids[v].count; m++)
+			csfmt_init_segs(&csfmt_segs[base + m], v, m);
+		base += 1 << csfmt_ids[v].count;
+	}
+}
+
+/* Bits 0 of the even bytes of a half, gathered in bits 0 to 3 */
+static inline unsigned int csfmt_even_bits(uint64_t half)
+{
+	half &= CSFMT_EVEN_LSB;
+	return (half | half >> 15 | half >> 30 | half >> 45) & 0xf;
+}
+
+int csfmt_decoder_init(struct csfmt_decoder_t *dec)
+{
+	int id;
+
+	pthread_once(&csfmt_tables_once, csfmt_init_tables);
+
+	memset(dec, 0, sizeof(*dec));
+	dec->id = CSFMT_IDS;
+
+	for (id = 0; id < CSFMT_IDS; id++)
+		dec->sink[id] = &dec->streams[id];
+	dec->sink[CSFMT_ID_NULL] = &dec->dropped;
+	for (id = CSFMT_ID_RESERVED; id < CSFMT_IDS; id++)
+		dec->sink[id] = &dec->dropped;
+	dec->sink[CSFMT_IDS] = &dec->unknown;
+
+	return 0;
+}
+
+void csfmt_decoder_destroy(struct csfmt_decoder_t *dec)
+{
+	int id;
+
+	for (id = 0; id < CSFMT_IDS; id++)
+		free(dec->streams[id].buf);
+	free(dec->dropped.buf);
+	free(dec->unknown.buf);
+	memset(dec, 0, sizeof(*dec));
+}
+
+static int csfmt_grow(struct csfmt_stream_t *s)
+{
+	size_t new_size = s->size ? 2 * s->size : 4096;
+	char *buf;
+
+	buf = realloc(s->buf, new_size);
+	if (buf == NULL)
+		return -1;
+	s->buf = buf;
+	s->size = new_size;
+
+	return 0;
+}
+
+/*
+ * Appends len bytes from data, and the byte after them if x, to the stream
+ * of id.  16 bytes are written at once, and data has room for it.
+ */
+static inline int csfmt_emit(struct csfmt_decoder_t *dec, int id,
+			     const uint8_t *data, unsigned int len,
+			     unsigned int x)
+{
+	struct csfmt_stream_t *s = dec->sink[id];
+
+	if (s->size - s->len < CSFMT_FRAME_SIZE && csfmt_grow(s))
+		return -1;
+
+	memcpy(s->buf + s->len, data, CSFMT_FRAME_SIZE);
+	s->buf[s->len + len] = data[len + 1];
+	s->len += len + x;
+	s->total += len + x;
+
+	return 0;
+}
+
+static int csfmt_frame(struct csfmt_decoder_t *dec, const uint8_t *frame)
+{
+	const struct csfmt_segs_t *e;
+	uint64_t half[4] = { 0 };	/* room for the 16-byte loads */
+	uint8_t *data = (uint8_t *) half;
+	uint8_t flags = frame[CSFMT_FRAME_SIZE - 1];
+	unsigned int ids, delayed, i, seg;
+	int id = dec->id;
+
+	dec->frames++;
+
+	memcpy(half, frame, CSFMT_FRAME_SIZE);
+	ids = csfmt_even_bits(half[0]) | csfmt_even_bits(half[1]) << 4;
+	half[0] = (half[0] & ~CSFMT_EVEN_LSB) | csfmt_lsb[0][flags];
+	half[1] = (half[1] & ~CSFMT_EVEN_LSB) | csfmt_lsb[1][flags];
+
+	/* Most frames have a single source: the whole frame is one segment */
+	if (ids == 0) {
+		if (csfmt_emit(dec, id, data, CSFMT_FRAME_SIZE - 1, 0))
+			return -1;
+		goto out;
+	}
+
+	delayed = csfmt_pext4[ids & 0xf][flags & 0xf] |
+		  csfmt_pext4[ids >> 4][flags >> 4] <<
+		  csfmt_ids[ids & 0xf].count;
+	e = &csfmt_segs[csfmt_segs_base[ids] + delayed];
+
+	for (i = 0; i < e->count; i++) {
+		seg = e->seg[i];
+		if (csfmt_emit(dec, id, data + (seg & 0xf), seg >> 4,
+			       e->delayed >> i & 1))
+			return -1;
+		id = frame[e->id[i]] >> 1;
+	}
+	seg = e->seg[i];
+	if (csfmt_emit(dec, id, data + (seg & 0xf), seg >> 4, 0))
+		return -1;
+	dec->id = id;
+
+out:
+	dec->dropped.len = 0;
+	dec->unknown.len = 0;
+	return 0;
+}
+
+/*
+ * Splits the data of the frames in buf among the streams of their sources.
+ * A frame split across two calls is kept until the next one.
+ * Returns -1 if out of memory.
+ */
+int csfmt_decoder_feed(struct csfmt_decoder_t *dec, const void *buf,
+		       size_t size)
+{
+	const uint8_t *p = buf, *end = p + size;
+	size_t n;
+
+	n = dec->skip < size ? dec->skip : size;
+	p += n;
+	dec->skip -= n;
+
+	if (dec->frame_len > 0) {
+		n = CSFMT_FRAME_SIZE - dec->frame_len;
+		if (n > end - p)
+			n = end - p;
+		memcpy(dec->frame + dec->frame_len, p, n);
+		dec->frame_len += n;
+		p += n;
+		if (dec->frame_len < CSFMT_FRAME_SIZE)
+			return 0;
+		dec->frame_len = 0;
+		if (csfmt_frame(dec, dec->frame))
+			return -1;
+	}
+
+	for (; end - p >= CSFMT_FRAME_SIZE; p += CSFMT_FRAME_SIZE)
+		if (csfmt_frame(dec, p))
+			return -1;
+
+	dec->frame_len = end - p;
+	memcpy(dec->frame, p, dec->frame_len);
+
+	return 0;
+}
+
+/*
+ * Data was lost before the next call, which starts skip bytes before a
+ * frame.  The source in effect is kept: with a single one it is still
+ * right, with several it is until the next ID change.
+ */
+void csfmt_decoder_gap(struct csfmt_decoder_t *dec, size_t skip)
+{
+	dec->frame_len = 0;
+	dec->skip = skip;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2013 - Adrien Vergé <adrienverge@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <signal.h>
+#ifndef LIBCSFMT_H
+#define LIBCSFMT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * CoreSight formatter frames.
+ *
+ * With formatting enabled, the ETB stores the trace of all the ATB sources
+ * in 16-byte frames.  Bytes 0 to 14 carry data, except for even bytes with
+ * bit 0 set, which switch to the source whose ID is in bits 7:1.  Byte 15
+ * holds bit 0 of the even data bytes (bit k for byte 2k); for an ID change,
+ * its bit tells that the next byte still belongs to the previous source.
+ * ID 0 is padding, and IDs from 0x70 on are reserved.
+ */
+#define CSFMT_FRAME_SIZE	16
+#define CSFMT_IDS		128
+#define CSFMT_ID_NULL		0x00
+#define CSFMT_ID_RESERVED	0x70
+
+/* Room for the frames written by csfmt_encode() on size bytes */
+#define CSFMT_ENCODE_MAX(size)	(CSFMT_FRAME_SIZE * ((size) / 14 + 2))
+
+struct csfmt_encoder_t {
+	uint8_t frame[CSFMT_FRAME_SIZE];
+	int pos;		/* next byte of the frame */
+	int id;			/* source in effect, -1 before the first */
+};
+
+void csfmt_encoder_init(struct csfmt_encoder_t *enc);
+size_t csfmt_encode(struct csfmt_encoder_t *enc, int id, const void *data,
+		    size_t size, void *out);
+size_t csfmt_encode_flush(struct csfmt_encoder_t *enc, void *out);
+
+/*
+ * Data of one source.  The decoder appends to buf; the caller consumes it
+ * and sets len back to 0.
+ */
+struct csfmt_stream_t {
+	char *buf;
+	size_t len, size;
+	uint64_t total;		/* bytes received */
+};
+
+struct csfmt_decoder_t {
+	int id;			/* source in effect, CSFMT_IDS if unknown */
+	uint8_t frame[CSFMT_FRAME_SIZE];	/* partial frame */
+	size_t frame_len;
+	size_t skip;		/* bytes to drop up to the next frame */
+	uint64_t frames;
+	struct csfmt_stream_t streams[CSFMT_IDS];
+
+	/*
+	 * Data that is dropped: of padding and reserved IDs, and before the
+	 * first ID (unknown.total bytes).  Their buffers are reused at each
+	 * frame.
+	 */
+	struct csfmt_stream_t dropped, unknown;
+	/* Stream of each ID, and unknown for CSFMT_IDS */
+	struct csfmt_stream_t *sink[CSFMT_IDS + 1];
+};
+
+int csfmt_decoder_init(struct csfmt_decoder_t *dec);
+void csfmt_decoder_destroy(struct csfmt_decoder_t *dec);
+int csfmt_decoder_feed(struct csfmt_decoder_t *dec, const void *buf,
+		       size_t size);
+void csfmt_decoder_gap(struct csfmt_decoder_t *dec, size_t skip);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,49 +16,121 @@
  */
 
 #include <signal.h>
+#include <string.h>
+
 #include "libomap4430.h"
 #include "libetb.h"
 
+/*
+ * On the TI ETB, reading in the RBD window returns the next RAM word and
+ * advances RRP, like RRD.  Elsewhere, RRP is left alone.
+ */
+static int etb_has_burst(struct etb_handle_t *etb_handle)
+{
+	uint32_t rrp = etb_read_reg(ETB_RRP);
+	int ret;
+
+	etb_read_reg(ETB_RBD);
+	ret = etb_read_reg(ETB_RRP) != rrp;
+	etb_write_reg(rrp, ETB_RRP);
+	etb_handle->rrp = rrp;
+
+	return ret;
+}
+
+/*
+ * The ETB is unlocked by the outermost of nested calls, and locked again
+ * when it returns.
+ */
+static void etb_unlock(struct etb_handle_t *etb_handle)
+{
+	if (etb_handle->unlocked++ == 0)
+		coresight_unlock(etb_handle->base);
+}
+
+static void etb_lock(struct etb_handle_t *etb_handle)
+{
+	if (--etb_handle->unlocked == 0)
+		coresight_lock(etb_handle->base);
+}
+
 int etb_open(struct etb_handle_t *etb_handle)
 {
 	int ret = -1;
+	OMAP4430_OP_START();
 
 	etb_handle->base = map_page(CS_ETB);
 	if (etb_handle->base == NULL)
 		goto end;
+	etb_handle->unlocked = 0;
 
-	coresight_unlock(etb_handle->base);
+	etb_unlock(etb_handle);
 
 	/* ETB FIFO reset by writing 0 to ETB RAM Write Pointer Register. */
 	etb_write_reg(0, ETB_RWP);
 	/* Disable formatting and put ETB formatter into bypass mode. */
 	etb_write_reg(0, ETB_FFCR);
+	etb_handle->ffcr = 0;
 	/* Setup Trigger counter. */
 	etb_write_reg(0, ETB_TRIG);
 
-	ret = 0;
+	etb_handle->burst = etb_has_burst(etb_handle);
+	/* Retrievals are sized from it */
+	etb_handle->depth = etb_read_reg(ETB_RDP);
+	etb_handle->ctl = etb_read_reg(ETB_CTL);
+
+	ret = etb_handle->depth > 0 ? 0 : -1;
 
-	coresight_lock(etb_handle->base);
+	etb_lock(etb_handle);
 
 end:
+	OMAP4430_OP_END();
 	return ret;
 }
 
 void etb_close(struct etb_handle_t *etb_handle)
 {
+	if (etb_handle->unlocked > 0)
+		coresight_lock(etb_handle->base);
 	unmap_page(etb_handle->base);
 	etb_handle->base = NULL;
 }
 
+/*
+ * Keeps the ETB unlocked until the matching etb_end(), for a sequence of
+ * calls that would otherwise unlock and lock it each.
+ */
+void etb_begin(struct etb_handle_t *etb_handle)
+{
+	OMAP4430_OP_START();
+	etb_unlock(etb_handle);
+	OMAP4430_OP_END();
+}
+
+void etb_end(struct etb_handle_t *etb_handle)
+{
+	OMAP4430_OP_START();
+	etb_lock(etb_handle);
+	OMAP4430_OP_END();
+}
+
 int etb_enable(struct etb_handle_t *etb_handle)
 {
 	int ret = -1;
 	int timeout = GLOBAL_TIMEOUT;
+	OMAP4430_OP_START();
 
-	coresight_unlock(etb_handle->base);
+	etb_unlock(etb_handle);
 
 	etb_write_reg(0, ETB_RRP); // RAM Read Pointer Register
 	etb_write_reg(0, ETB_RWP); // RAM Write Pointer Register
+	etb_handle->rrp = 0;
+
+	/* Already enabled, and read back then */
+	if (etb_handle->ctl & 0x1) {
+		ret = 0;
+		goto relock;
+	}
 
 	/* Enable ETB data capture by writing ETB Control Register. */
 	etb_write_reg(1, ETB_CTL);
@@ -66,12 +138,15 @@ int etb_enable(struct etb_handle_t *etb_handle)
 	/* Put some delays in here - make sure we can read back. */
 	while (--timeout)
 		if ((etb_read_reg(ETB_CTL) & 0x1) == 0x1) {
+			etb_handle->ctl = 1;
 			ret = 0;
 			break;
 		}
 
-	coresight_lock(etb_handle->base);
+relock:
+	etb_lock(etb_handle);
 
+	OMAP4430_OP_END();
 	return ret;
 }
 
@@ -79,31 +154,68 @@ int etb_disable(struct etb_handle_t *etb_handle)
 {
 	int ret = -1;
 	int timeout = GLOBAL_TIMEOUT;
+	OMAP4430_OP_START();
+
+	etb_unlock(etb_handle);
 
-	coresight_unlock(etb_handle->base);
+	/* Manual flush, the bit clears itself */
+	etb_write_reg(etb_handle->ffcr | ETB_FFCR_FLUSHMAN, ETB_FFCR);
 
-	/* Manual flush */
-	etb_write_reg(etb_read_reg(ETB_FFCR)|(1<<6), ETB_FFCR);
+	if (!(etb_handle->ctl & 0x1)) {
+		ret = 0;
+		goto relock;
+	}
 
 	/* Disable ETB data capture by writing ETB Control Register. */
 	etb_write_reg(0, ETB_CTL);
 
 	while (--timeout)
 		if ((etb_read_reg(ETB_CTL) & 0x1) == 0x0) {
+			etb_handle->ctl = 0;
 			ret = 0;
 			break;
 		}
 
-	coresight_lock(etb_handle->base);
+relock:
+	etb_lock(etb_handle);
 
+	OMAP4430_OP_END();
 	return ret;
 }
 
+/*
+ * etb_open() puts the formatter in bypass: the RAM holds the raw stream of
+ * the only ATB source.  With formatting on, it holds the CoreSight frames
+ * of all of them (see libcsfmt), four words each from RWP 0 on.  Capture
+ * must be disabled.
+ */
+int etb_set_formatter(struct etb_handle_t *etb_handle, int on)
+{
+	OMAP4430_OP_START();
+
+	if (etb_handle->ctl & 0x1) {
+		OMAP4430_OP_END();
+		return -1;
+	}
+
+	if (on)
+		etb_handle->ffcr |= ETB_FFCR_ENFTC;
+	else
+		etb_handle->ffcr &= ~ETB_FFCR_ENFTC;
+
+	etb_unlock(etb_handle);
+	etb_write_reg(etb_handle->ffcr, ETB_FFCR);
+	etb_lock(etb_handle);
+
+	OMAP4430_OP_END();
+	return 0;
+}
+
 int etb_status(struct etb_handle_t *etb_handle)
 {
 	int ret = -1;
 
-	coresight_unlock(etb_handle->base);
+	etb_unlock(etb_handle);
 
 	/*// try to enable interrupts
 	etb_write_reg((TI_ETB_IRST_FULL | TI_ETB_IRST_HALF_FULL), ETB_IER);
@@ -125,20 +237,100 @@ int etb_status(struct etb_handle_t *etb_handle)
 
 	ret = 0;
 
-	coresight_lock(etb_handle->base);
+	etb_lock(etb_handle);
 
 	return ret;
 }
 
-ssize_t etb_retrieve(struct etb_handle_t *etb_handle, void *buf0, size_t bufsize /* in bytes */)
+/*
+ * Reads count words from RRP on, through the burst read window if there is
+ * one.  RRP wraps around the RAM.
+ */
+static void etb_read_words(struct etb_handle_t *etb_handle, void *buf,
+			   size_t count)
 {
-	char *buf = (char *) buf0;
-	ssize_t size = -1; /* in bytes */
-	ssize_t	size_in_u32; /* in uint32_t */
-	void *start, *end;
-	off_t offset;
+	size_t n;
 
-	coresight_unlock(etb_handle->base);
+	if (!etb_handle->burst) {
+		for (; count > 0; count--, buf += 4)
+			*((uint32_t *) buf) = etb_read_reg(ETB_RRD);
+		return;
+	}
+
+	for (; count > 0; count -= n, buf += 4 * n) {
+		n = count < ETB_RBD_SIZE / 4 ? count : ETB_RBD_SIZE / 4;
+		omap4430_read_words(buf, etb_handle->base + ETB_RBD, n);
+	}
+}
+
+/* Whole words that the segments of iov hold */
+static size_t etb_iov_words(const struct iovec *iov, int iovcnt)
+{
+	size_t words = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		words += iov[i].iov_len / 4;
+
+	return words;
+}
+
+/*
+ * Reads count words from start on into the segments of iov, from word k of
+ * them on, each segment filled with whole words before the next; they
+ * must have room for it.  RRP is only written when the previous read did
+ * not end there.
+ */
+static void etb_read_iov(struct etb_handle_t *etb_handle, uint32_t start,
+			 size_t k, size_t count, const struct iovec *iov)
+{
+	size_t n;
+
+	if (start != etb_handle->rrp)
+		etb_write_reg(start, ETB_RRP);
+	etb_handle->rrp = (start + count) % etb_handle->depth;
+
+	for (; k >= iov->iov_len / 4; iov++)
+		k -= iov->iov_len / 4;
+
+	for (; count > 0; count -= n, k = 0, iov++) {
+		n = iov->iov_len / 4 - k;
+		if (n > count)
+			n = count;
+		etb_read_words(etb_handle, (uint32_t *) iov->iov_base + k, n);
+	}
+}
+
+/* Word k of what etb_read_iov() read */
+static uint32_t *etb_iov_word(const struct iovec *iov, size_t k)
+{
+	while (k >= iov->iov_len / 4) {
+		k -= iov->iov_len / 4;
+		iov++;
+	}
+
+	return (uint32_t *) iov->iov_base + k;
+}
+
+/*
+ * Reads what the ETB RAM holds, oldest first, into the segments of iov.
+ * Once RWP has wrapped around (full flag of STS), that is the whole RAM
+ * from RWP on, else the words from RRP to RWP.  The segments are filled in
+ * order, each with whole words; together they must hold the RAM depth
+ * (etb_handle->depth) to get a full RAM.  When a caller's ring wraps, its
+ * two segments thus get the oldest words, then the newest.  Capture should
+ * be disabled.
+ * Returns the number of bytes read.
+ */
+ssize_t etb_retrieve_iov(struct etb_handle_t *etb_handle,
+			 const struct iovec *iov, int iovcnt)
+{
+	uint32_t depth = etb_handle->depth;
+	uint32_t start, rwp;
+	size_t count;
+	OMAP4430_OP_START();
+
+	etb_unlock(etb_handle);
 
 	/*
 	 * ETB Formatter and Flush Control Register FFCR
@@ -155,67 +347,419 @@ ssize_t etb_retrieve(struct etb_handle_t *etb_handle, void *buf0, size_t bufsize
 	 * (In this mode, no formatting information is inserted into the trace
 	 * stream and a raw reproduction of the incoming trace stream is stored.)
 	 */
-	//uint32_t ffcr = etb_read_reg(0x304);
-	//printf("ffcr = 0x%x\n", ffcr);
-	//etb_write_reg(0, 0x304);
-
-	start = (void *) etb_read_reg(ETB_RRP);
-	end = (void *) etb_read_reg(ETB_RWP); // number of available words
-
-	size_in_u32 = end - start;
-	/*printf("start = %p\n", start);
-	printf("end   = %p\n", end);//*/
-	etb_write_reg(0, ETB_RRP);
-
-	/*etb_status();
-	printf("%08x ", (uint32_t) etb_read_reg(0x10));
-	etb_write_reg(4, 0x14);
-	printf("%08x ", (uint32_t) etb_read_reg(0x10));
-	printf("%08x ", (uint32_t) etb_read_reg(0x10));
-	printf("%08x ", (uint32_t) etb_read_reg(0x10));
-	printf("\n");
-	etb_status();*/
-
-	// read addr > write addr: error
-	if (size_in_u32 < 0) {
-		goto end;
-	//} else if (start == end) {
-	//} else if (start + 4 >= end) {
-	//	size = 0;
+
+	rwp = etb_read_reg(ETB_RWP);
+	if (etb_read_reg(ETB_STS) & 0x1) {
+		start = rwp;
+		count = depth;
 	} else {
-		size = 4 * size_in_u32;
-		if (size > bufsize)
-			size = bufsize;
-
-		for (offset = 0; offset < size; offset += 4)
-			*((uint32_t *) &buf[offset]) = etb_read_reg(ETB_RRD);
-
-		/*
-		 * Coresight ETB adds 0x01 0x00 0x00 0x00... (up to 15 bytes
-		 * of 0x00) so we do a little trick to remove them
-		 */
-		/*
-		off_t i;
-		for (i = size - 1; i > size - 1 - 16; i--) {
-			if ((uint8_t) buf[i] == 0x0)
-				size--;
-			else if ((uint8_t) buf[i] == 0x1) {
-				size--;
-				break;
-			} else
-				break;
-		}*/
-		if (size == 16 &&
-		    *((uint32_t *) &buf[0]) == 0x00000001 &&
-		    *((uint32_t *) &buf[4]) == 0x00000000 &&
-		    *((uint32_t *) &buf[8]) == 0x00000000 &&
-		    *((uint32_t *) &buf[12]) == 0x00000000) {
-			size = 0;
-		}
+		start = etb_handle->rrp;
+		count = (rwp + depth - start) % depth;
 	}
 
-end:
-	coresight_lock(etb_handle->base);
+	if (count > etb_iov_words(iov, iovcnt))
+		count = etb_iov_words(iov, iovcnt);
+	etb_read_iov(etb_handle, start, 0, count, iov);
+
+	etb_lock(etb_handle);
+
+	OMAP4430_OP_END();
+	return 4 * count;
+}
+
+ssize_t etb_retrieve(struct etb_handle_t *etb_handle, void *buf0, size_t bufsize /* in bytes */)
+{
+	char *buf = (char *) buf0;
+	struct iovec iov = { .iov_base = buf0, .iov_len = bufsize };
+	ssize_t size; /* in bytes */
+
+	size = etb_retrieve_iov(etb_handle, &iov, 1);
+
+	/*
+	 * Coresight ETB adds 0x01 0x00 0x00 0x00... (up to 15 bytes
+	 * of 0x00) so we do a little trick to remove them
+	 */
+	if (size == 16 &&
+	    *((uint32_t *) &buf[0]) == 0x00000001 &&
+	    *((uint32_t *) &buf[4]) == 0x00000000 &&
+	    *((uint32_t *) &buf[8]) == 0x00000000 &&
+	    *((uint32_t *) &buf[12]) == 0x00000000) {
+		size = 0;
+	}
 
 	return size;
 }
+
+/*
+ * Writes size bytes (rounded down to words) to the ETB RAM through RWD,
+ * from RWP on, as if they had been captured.  Capture must be disabled.
+ * Used to test and measure etb_retrieve().
+ */
+ssize_t etb_load(struct etb_handle_t *etb_handle, const void *buf0, size_t size)
+{
+	const char *buf = (const char *) buf0;
+	off_t offset;
+	OMAP4430_OP_START();
+
+	etb_unlock(etb_handle);
+
+	size -= size % 4;
+	for (offset = 0; offset < size; offset += 4)
+		etb_write_reg(*((uint32_t *) &buf[offset]), ETB_RWD);
+
+	etb_lock(etb_handle);
+
+	OMAP4430_OP_END();
+	return size;
+}
+
+/*
+ * Continuous capture
+ */
+
+static double etb_elapsed(const struct timespec *from,
+			  const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+	       (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/*
+ * Enables capture for etb_drain(), which can then be called while it goes
+ * on.  etb_disable() stops it.
+ */
+int etb_start(struct etb_handle_t *etb_handle)
+{
+	int ret;
+	OMAP4430_OP_START();
+
+	etb_handle->rwp = 0;
+	etb_handle->pending = 0;
+	etb_handle->words = 0;
+	etb_handle->lost = 0;
+	etb_handle->overruns = 0;
+	etb_handle->suspects = 0;
+	clock_gettime(CLOCK_MONOTONIC, &etb_handle->drained);
+
+	etb_unlock(etb_handle);
+	/* Wraps before now do not matter */
+	etb_write_reg(TI_ETB_IRST_FULL, ETB_ICST);
+	ret = etb_enable(etb_handle);
+	etb_lock(etb_handle);
+
+	OMAP4430_OP_END();
+	return ret;
+}
+
+/*
+ * Finds how many words were written since the previous drain: RWP only
+ * gives it modulo the depth, so the TI full status, raised each time RWP
+ * wraps to 0, tells whether it went past the previous position.  It is
+ * cleared at every drain where it is found raised; a wrap between the two
+ * reads of RWP is counted here even if it raised the status after it was
+ * read.  If RWP wrapped more than once, only one wrap is counted: *wrapped
+ * tells whether it wrapped at all.
+ */
+static uint32_t etb_written(struct etb_handle_t *etb_handle, uint64_t *words,
+			    int *wrapped)
+{
+	uint32_t before, rwp, depth = etb_handle->depth;
+
+	before = etb_read_reg(ETB_RWP);
+	*wrapped = etb_read_reg(ETB_IRST) & TI_ETB_IRST_FULL;
+	if (*wrapped)
+		etb_write_reg(TI_ETB_IRST_FULL, ETB_ICST);
+	rwp = etb_read_reg(ETB_RWP);
+	if (rwp < before) {
+		*wrapped = 1;
+		etb_write_reg(TI_ETB_IRST_FULL, ETB_ICST);
+	}
+
+	*words = (rwp + depth - etb_handle->rwp) % depth;
+	/* RWP wrapped but is not behind: the whole RAM was written over */
+	if (*wrapped && rwp >= etb_handle->rwp)
+		*words += depth;
+
+	return rwp;
+}
+
+/*
+ * Reads the words written since the previous call, oldest first, into the
+ * segments of iov, without stopping capture (see etb_start()).  Those that
+ * do not fit are kept for the next call.
+ *
+ * Words overwritten before they could be read are counted in lost: those
+ * already overwritten when the call starts, and those that RWP reaches
+ * while they are read.  RWP is sampled every ETB_DRAIN_CHUNK words: the
+ * words of a chunk that it reached by the end of the chunk are dropped,
+ * even those that were read just before, so lost can exceed the true count
+ * by what is written while a chunk is read.  Once words are kept, the
+ * drain stops at the first chunk that RWP reached, so that what is
+ * returned has no hole: the next call counts what was lost there.  If RWP
+ * went round the RAM while a chunk was read (full status raised while its
+ * sampled position did not wrap), all the words read are dropped.
+ *
+ * RWP wrapping more than once between two calls is counted as once, so
+ * lost is a lower bound.  When RWP wrapped and, at the rate measured by
+ * etb_sched_wait(), more than the RAM depth was written since the
+ * previous call, the call is counted in suspects: words may have been lost
+ * before the ones it returns.
+ * Returns the number of bytes read.
+ */
+#define ETB_DRAIN_CHUNK		64	/* words read between samples of RWP */
+
+ssize_t etb_drain_iov(struct etb_handle_t *etb_handle,
+		      const struct iovec *iov, int iovcnt)
+{
+	uint32_t depth = etb_handle->depth;
+	uint32_t rwp, start, now, prev;
+	uint64_t written, pending, room, advance;
+	size_t count, done, kept, n, p, k;
+	struct timespec ts;
+	int wrapped;
+	OMAP4430_OP_START();
+
+	etb_unlock(etb_handle);
+
+	rwp = etb_written(etb_handle, &written, &wrapped);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (wrapped && etb_handle->rate *
+		       etb_elapsed(&etb_handle->drained, &ts) > depth)
+		etb_handle->suspects++;
+	etb_handle->drained = ts;
+	pending = etb_handle->pending + written;
+	if (pending > depth) {
+		etb_handle->lost += pending - depth;
+		etb_handle->overruns++;
+		pending = depth;
+	}
+	etb_handle->rwp = rwp;
+
+	count = pending;
+	if (count > etb_iov_words(iov, iovcnt))
+		count = etb_iov_words(iov, iovcnt);
+
+	/*
+	 * Word k of the drain is overwritten once RWP has advanced by more
+	 * than room + k
+	 */
+	start = (rwp + depth - pending) % depth;
+	room = depth - pending;
+	advance = 0;
+	prev = rwp;
+	done = kept = 0;
+	while (done < count) {
+		n = count - done < ETB_DRAIN_CHUNK ? count - done :
+						     ETB_DRAIN_CHUNK;
+		etb_read_iov(etb_handle, (start + done) % depth, kept, n, iov);
+
+		now = etb_read_reg(ETB_RWP);
+		advance += (now + depth - prev) % depth;
+		prev = now;
+
+		p = advance > room + done ? advance - room - done : 0;
+		if (p > n)
+			p = n;
+		if (p > 0 && kept > 0)
+			break;	/* left for the next call, as a hole */
+		if (p > 0)
+			for (k = p; k < n; k++)
+				*etb_iov_word(iov, kept + k - p) =
+					*etb_iov_word(iov, kept + k);
+		kept += n - p;
+		done += n;
+	}
+
+	/*
+	 * Full status raised without the sampled RWP wrapping.  RWP is read
+	 * again after it, as it may have wrapped since the last sample.
+	 */
+	if (rwp + advance < depth &&
+	    (etb_read_reg(ETB_IRST) & TI_ETB_IRST_FULL)) {
+		now = etb_read_reg(ETB_RWP);
+		advance += (now + depth - prev) % depth;
+		if (rwp + advance < depth)
+			kept = 0;
+	}
+
+	etb_lock(etb_handle);
+
+	if (done > kept) {
+		etb_handle->lost += done - kept;
+		etb_handle->overruns++;
+	}
+	/* Words are only dropped before the ones kept */
+	etb_handle->first = (start + done - kept) % depth;
+	etb_handle->pending = pending - done;
+	etb_handle->words += kept;
+
+	OMAP4430_OP_END();
+	return 4 * kept;
+}
+
+ssize_t etb_drain(struct etb_handle_t *etb_handle, void *buf, size_t bufsize)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = bufsize };
+
+	return etb_drain_iov(etb_handle, &iov, 1);
+}
+
+/*
+ * Words waiting for etb_drain() when RWP is at rwp.  IRST is only read when
+ * a wrap would change the result.
+ */
+static uint32_t etb_fill_at(struct etb_handle_t *etb_handle, uint32_t rwp)
+{
+	uint32_t depth = etb_handle->depth;
+	uint64_t fill;
+
+	fill = etb_handle->pending + (rwp + depth - etb_handle->rwp) % depth;
+	if (fill < depth && rwp >= etb_handle->rwp &&
+	    (etb_read_reg(ETB_IRST) & TI_ETB_IRST_FULL))
+		fill += depth;
+
+	return fill < depth ? fill : depth;
+}
+
+/*
+ * Returns the number of words waiting for etb_drain(), from RWP, without
+ * changing anything.  It is at most the RAM depth.
+ */
+uint32_t etb_fill(struct etb_handle_t *etb_handle)
+{
+	uint32_t fill;
+	OMAP4430_OP_START();
+
+	fill = etb_fill_at(etb_handle, etb_read_reg(ETB_RWP));
+
+	OMAP4430_OP_END();
+	return fill;
+}
+
+/*
+ * Drain scheduler
+ */
+
+void etb_sched_init(struct etb_sched_t *sched,
+		    struct etb_handle_t *etb_handle,
+		    unsigned int min_us, unsigned int max_us)
+{
+	memset(sched, 0, sizeof(*sched));
+	sched->min_us = min_us;
+	sched->max_us = max_us > min_us ? max_us : min_us;
+	sched->interval_us = sched->max_us;
+	sched->threshold = etb_handle->depth / 2;
+	sched->rwp = etb_handle->rwp;
+	clock_gettime(CLOCK_MONOTONIC, &sched->poll);
+	sched->drain = sched->poll;
+}
+
+/*
+ * A rise of the rate is followed at once, so that a burst shortens the
+ * interval from the next poll on; a fall slowly.
+ */
+static void etb_sched_adapt(struct etb_sched_t *sched, uint32_t written,
+			    double secs)
+{
+	double rate, us;
+
+	if (secs <= 0)
+		return;
+
+	rate = written / secs;
+	if (rate > sched->rate)
+		sched->rate = rate;
+	else
+		sched->rate += (rate - sched->rate) / 4;
+
+	us = sched->rate > 0 ? sched->threshold / 4 / sched->rate * 1e6 :
+			       sched->max_us;
+	if (us < sched->min_us)
+		us = sched->min_us;
+	if (us > sched->max_us)
+		us = sched->max_us;
+	sched->interval_us = us;
+}
+
+/*
+ * Returns the fill level, with one or two register reads
+ */
+static uint32_t etb_sched_poll(struct etb_sched_t *sched,
+			       struct etb_handle_t *etb_handle,
+			       const struct timespec *now)
+{
+	uint32_t depth = etb_handle->depth;
+	uint32_t fill, rwp;
+	OMAP4430_OP_START();
+
+	sched->polls++;
+
+	rwp = etb_read_reg(ETB_RWP);
+	etb_sched_adapt(sched, (rwp + depth - sched->rwp) % depth,
+			etb_elapsed(&sched->poll, now));
+	sched->rwp = rwp;
+	sched->poll = *now;
+	etb_handle->rate = sched->rate;
+
+	fill = etb_fill_at(etb_handle, rwp);
+
+	OMAP4430_OP_END();
+	return fill;
+}
+
+/*
+ * Sleeps until the RAM should be drained (see struct etb_sched_t).
+ * Returns the number of words waiting then, or -1 if interrupted by a
+ * signal or once *run is cleared (checked at each poll, so that a signal
+ * caught outside of the sleep is not missed).
+ */
+int etb_sched_wait(struct etb_sched_t *sched,
+		   struct etb_handle_t *etb_handle,
+		   volatile sig_atomic_t *run)
+{
+	uint32_t fill;
+	struct timespec ts, now;
+
+	for (;;) {
+		if (run != NULL && !*run)
+			return -1;
+		ts.tv_sec = sched->interval_us / 1000000;
+		ts.tv_nsec = sched->interval_us % 1000000 * 1000;
+		if (nanosleep(&ts, NULL))
+			return -1;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		fill = etb_sched_poll(sched, etb_handle, &now);
+		if (fill >= sched->threshold ||
+		    (fill > 0 && etb_elapsed(&sched->drain, &now) * 1e6 >=
+				 sched->max_us))
+			break;
+	}
+
+	sched->drain = now;
+	sched->drains++;
+	sched->fill_total += fill;
+	if (fill > sched->fill_max)
+		sched->fill_max = fill;
+
+	return fill;
+}
+
+void etb_sched_report(struct etb_sched_t *sched,
+		      struct etb_handle_t *etb_handle)
+{
+	fprintf(stderr, "%llu drains in %llu polls, fill at drain: mean %llu "
+		"max %u of %u words\n",
+		(unsigned long long) sched->drains,
+		(unsigned long long) sched->polls,
+		(unsigned long long) (sched->drains ?
+				      sched->fill_total / sched->drains : 0),
+		sched->fill_max, etb_handle->depth);
+	fprintf(stderr, "%llu overruns, at least %llu words lost, %llu words "
+		"read\n", (unsigned long long) etb_handle->overruns,
+		(unsigned long long) etb_handle->lost,
+		(unsigned long long) etb_handle->words);
+	if (etb_handle->suspects > 0)
+		fprintf(stderr, "%llu drains may have missed whole turns of "
+			"the RAM\n", (unsigned long long) etb_handle->suspects);
+}
@@ -21,6 +21,8 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdint.h>
 
@@ -50,6 +52,7 @@ extern "C" {
 /* Registers specific to TI-ETB implementation */
 #define ETB_WIDTH	0x008 /* ETB RAM Width Register STS */
 #define ETB_RBD		0xA00 /* ETB RAM burst read Register */
+#define ETB_RBD_SIZE	0x400 /* every word of it reads the next RAM word */
 #define ETB_TI_CTL	0xE20 /* ETB TI Control Register */
 #define ETB_IRST	0xE00 /* ETB TI Interrupt Raw Status Register */
 #define ETB_ICST	0xE04 /* ETB TI Interrupt Raw Status Register */
@@ -61,6 +64,9 @@ extern "C" {
 #define TI_ETB_IRST_FULL      (1 << 1)
 #define TI_ETB_IRST_HALF_FULL (1 << 0)
 
+#define ETB_FFCR_ENFTC		(1 << 0)	/* formatting */
+#define ETB_FFCR_FLUSHMAN	(1 << 6)	/* manual flush */
+
 #define coresight_lock(baseaddr)	__writel(0, (baseaddr) + CS_LAR)
 #define coresight_unlock(baseaddr)	\
 	__writel(CS_UNLOCK_VALUE, (baseaddr) + CS_LAR)
@@ -70,14 +76,72 @@ extern "C" {
 
 #define GLOBAL_TIMEOUT	100
 
+/*
+ * etb_open() sets burst if the ETB has the TI burst read window, which
+ * etb_retrieve() then uses instead of reading RRD word by word.  It can be
+ * cleared to force word reads.
+ */
 struct etb_handle_t {
 	void *base;
+	int burst;
+	uint32_t depth;		/* RAM words, from RDP */
+
+	/*
+	 * Registers only changed by the library, shadowed so that they are
+	 * not read back (RRP only moves with the reads of the library).
+	 * unlocked counts the nested sessions, see etb_begin().
+	 */
+	uint32_t ctl, ffcr, rrp;
+	int unlocked;
+
+	/* Continuous capture, see etb_start() and etb_drain() */
+	uint32_t rwp;		/* RWP at the previous drain */
+	uint32_t pending;	/* words written before it, not read yet */
+	uint32_t first;		/* RAM word of the first word it returned */
+	uint64_t words;		/* words read */
+	uint64_t lost;		/* overwritten before being read, see
+				   etb_drain_iov() */
+	uint64_t overruns;	/* drains that found words overwritten */
+	uint64_t suspects;	/* drains after which RWP may have gone
+				   round more than once */
+	double rate;		/* words per second, set by etb_sched_wait() */
+	struct timespec drained; /* time of the previous drain */
+};
+
+/*
+ * Drain scheduler for continuous capture: etb_sched_wait() polls the fill
+ * level of the RAM, and returns when half of it is waiting to be drained,
+ * or when data has waited for max_us.  The poll interval follows the rate
+ * at which the RAM fills, between min_us and max_us: a quarter of the
+ * threshold is written between two polls.
+ */
+#define ETB_SCHED_MIN_US	100
+#define ETB_SCHED_MAX_US	10000
+
+struct etb_sched_t {
+	unsigned int min_us, max_us;
+	unsigned int interval_us;	/* current poll interval */
+	uint32_t threshold;		/* words that trigger a drain */
+	double rate;			/* words per second */
+	uint32_t rwp;			/* RWP at the previous poll */
+	struct timespec poll, drain;	/* time of the previous ones */
+
+	uint64_t polls;
+	uint64_t drains;
+	uint64_t fill_total;		/* sum of the fill levels at drains */
+	uint32_t fill_max;
 };
 
 int etb_open(struct etb_handle_t *etb_handle);
 
 void etb_close(struct etb_handle_t *etb_handle);
 
+void etb_begin(struct etb_handle_t *etb_handle);
+
+void etb_end(struct etb_handle_t *etb_handle);
+
+int etb_set_formatter(struct etb_handle_t *etb_handle, int on);
+
 int etb_enable(struct etb_handle_t *etb_handle);
 
 int etb_disable(struct etb_handle_t *etb_handle);
@@ -86,6 +150,31 @@ int etb_status(struct etb_handle_t *etb_handle);
 
 ssize_t etb_retrieve(struct etb_handle_t *etb_handle, void *buf, size_t bufsize);
 
+ssize_t etb_retrieve_iov(struct etb_handle_t *etb_handle,
+			 const struct iovec *iov, int iovcnt);
+
+ssize_t etb_load(struct etb_handle_t *etb_handle, const void *buf, size_t size);
+
+int etb_start(struct etb_handle_t *etb_handle);
+
+ssize_t etb_drain(struct etb_handle_t *etb_handle, void *buf, size_t bufsize);
+
+ssize_t etb_drain_iov(struct etb_handle_t *etb_handle,
+		      const struct iovec *iov, int iovcnt);
+
+uint32_t etb_fill(struct etb_handle_t *etb_handle);
+
+void etb_sched_init(struct etb_sched_t *sched,
+		    struct etb_handle_t *etb_handle,
+		    unsigned int min_us, unsigned int max_us);
+
+int etb_sched_wait(struct etb_sched_t *sched,
+		   struct etb_handle_t *etb_handle,
+		   volatile sig_atomic_t *run);
+
+void etb_sched_report(struct etb_sched_t *sched,
+		      struct etb_handle_t *etb_handle);
+
 #ifdef __cplusplus
 }
 #endif
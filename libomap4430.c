@@ -16,13 +16,54 @@
  */
 
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "libomap4430.h"
+#include "libsim.h"
+
+const struct omap4430_backend_t *omap4430_backend;
+
+static int backend_chosen;
+
+void omap4430_set_backend(const struct omap4430_backend_t *backend)
+{
+	omap4430_backend = backend;
+	backend_chosen = 1;
+}
+
+/*
+ * Unless a backend was set, the simulated device is used when SIM_ENV names
+ * its state file.
+ */
+static int choose_backend(void)
+{
+	const char *path;
+
+	if (backend_chosen)
+		return 0;
+
+	path = getenv(SIM_ENV);
+	if (path != NULL && *path != '\0') {
+		if (sim_attach(path))
+			return -1;
+		omap4430_backend = &sim_backend;
+	}
+	backend_chosen = 1;
+
+	return 0;
+}
 
 void *map_region(uint32_t hw_addr, size_t size)
 {
 	void *vaddr = NULL;
 	int fd;
 
+	if (choose_backend())
+		goto end;
+	if (omap4430_backend != NULL)
+		return omap4430_backend->map_region(hw_addr, size);
+
 	if ((fd = open("/dev/mem", O_RDWR|O_SYNC)) < 0) {
 		printf("error: open failed\n");
 		goto end;
@@ -42,6 +83,92 @@ end:
 	return vaddr;
 }
 
+/*
+ * Reads count 32-bit registers at consecutive addresses, in order.  On ARM,
+ * they are loaded 4 at a time with ldm, which the interconnect can turn into
+ * a burst.
+ */
+void omap4430_read_words(uint32_t *dst, void *addr, size_t count)
+{
+	size_t k = 0;
+
+	if (omap4430_backend != NULL) {
+		__count(omap4430_reads, count);
+		if (omap4430_backend->read_words != NULL)
+			omap4430_backend->read_words(dst, addr, count);
+		else
+			for (k = 0; k < count; k++)
+				dst[k] = omap4430_backend->read(addr + 4 * k, 4);
+		return;
+	}
+
+#ifdef __arm__
+	/* ldm and stm need aligned addresses */
+	if ((uintptr_t) dst % 4 == 0 && (uintptr_t) addr % 4 == 0)
+		for (; k + 4 <= count; k += 4)
+			__asm__ __volatile__(
+				"ldmia %[src], {r4, r5, r6, r8}\n\t"
+				"stmia %[dst], {r4, r5, r6, r8}\n\t"
+				: : [src] "r" (addr + 4 * k), [dst] "r" (dst + k)
+				: "r4", "r5", "r6", "r8", "memory");
+	__count(omap4430_reads, k);
+#endif
+	for (; k < count; k++)
+		dst[k] = __readl(addr + 4 * k);
+}
+
+/*
+ * Register accesses per operation, see OMAP4430_OP_START()
+ */
+
+#define OMAP4430_MAX_OPS	32
+
+struct omap4430_op_t {
+	const char *name;
+	unsigned long calls, reads, writes;
+};
+
+static struct omap4430_op_t omap4430_ops[OMAP4430_MAX_OPS];
+
+#if defined(OMAP4430_COUNT_ACCESSES)
+unsigned long omap4430_reads, omap4430_writes;
+#endif
+
+void omap4430_op_account(const char *op, unsigned long reads,
+			 unsigned long writes)
+{
+	int i;
+
+	for (i = 0; i < OMAP4430_MAX_OPS; i++) {
+		if (omap4430_ops[i].name == NULL)
+			omap4430_ops[i].name = op;
+		if (strcmp(omap4430_ops[i].name, op) == 0)
+			break;
+	}
+	if (i == OMAP4430_MAX_OPS)
+		return;
+
+	omap4430_ops[i].calls++;
+	omap4430_ops[i].reads += reads;
+	omap4430_ops[i].writes += writes;
+}
+
+/*
+ * Prints the register accesses of each operation, if they were counted
+ */
+void omap4430_op_report(FILE *f)
+{
+	struct omap4430_op_t *op;
+	int i;
+
+	for (i = 0; i < OMAP4430_MAX_OPS && omap4430_ops[i].name != NULL; i++) {
+		op = &omap4430_ops[i];
+		fprintf(f, "%-20s %8lu calls %8.1f reads %6.1f writes per call\n",
+			op->name, op->calls, (double) op->reads / op->calls,
+			(double) op->writes / op->calls);
+	}
+}
+
 void *map_page(uint32_t hw_addr)
 {
 	return map_region(hw_addr, 0x1000);
@@ -49,7 +176,10 @@ void *map_page(uint32_t hw_addr)
 
 void unmap_region(void *vaddr, size_t size)
 {
-	munmap(vaddr, size);
+	if (omap4430_backend != NULL)
+		omap4430_backend->unmap_region(vaddr, size);
+	else
+		munmap(vaddr, size);
 }
 
 void unmap_page(void *vaddr)
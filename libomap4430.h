@@ -37,15 +37,74 @@ extern "C" {
 //#define __read_reg(addr)	*((uint32_t *) (addr))
 //#define __write_reg(val, addr)	*((uint32_t *) (addr)) = (val)
 
-#define __readb(addr)		*((volatile uint8_t *) (addr))
-#define __writeb(val, addr)	*((volatile uint8_t *) (addr)) = (val)
-#define __readw(addr)		*((volatile uint16_t *) (addr))
-#define __writew(val, addr)	*((volatile uint16_t *) (addr)) = (val)
-#define __readl(addr)		*((volatile uint32_t *) (addr))
-#define __writel(val, addr)	*((volatile uint32_t *) (addr)) = (val)
+/*
+ * Register windows are mapped and accessed through a backend.  Without one
+ * (the default), they are mapped from /dev/mem and accessed directly; a
+ * backend such as the simulated device of libsim sees every access.
+ */
+struct omap4430_backend_t {
+	void *(*map_region)(uint32_t hw_addr, size_t size);
+	void (*unmap_region)(void *vaddr, size_t size);
+	uint32_t (*read)(void *addr, int size);
+	void (*write)(uint32_t val, void *addr, int size);
+	/* optional, see omap4430_read_words() */
+	void (*read_words)(uint32_t *dst, void *addr, size_t count);
+};
+
+extern const struct omap4430_backend_t *omap4430_backend;
+
+/*
+ * Built with OMAP4430_COUNT_ACCESSES (make COUNT_ACCESSES=1), register
+ * accesses are counted, and the libraries add up those of each of their
+ * operations, callees included, for omap4430_op_report().
+ */
+#if defined(OMAP4430_COUNT_ACCESSES)
+extern unsigned long omap4430_reads, omap4430_writes;
+#define __count(var, n)		((var) += (n))
+#define OMAP4430_OP_START() \
+	unsigned long __op_reads = omap4430_reads; \
+	unsigned long __op_writes = omap4430_writes
+#define OMAP4430_OP_END() \
+	omap4430_op_account(__func__, omap4430_reads - __op_reads, \
+			    omap4430_writes - __op_writes)
+#else
+#define __count(var, n)		((void) 0)
+#define OMAP4430_OP_START()	do { } while (0)
+#define OMAP4430_OP_END()	do { } while (0)
+#endif
+
+#define __read(type, addr) \
+	(__count(omap4430_reads, 1), \
+	 omap4430_backend == NULL ? *((volatile type *) (addr)) : \
+	 (type) omap4430_backend->read((void *) (addr), sizeof(type)))
+#define __write(type, val, addr) \
+	do { \
+		__count(omap4430_writes, 1); \
+		if (omap4430_backend == NULL) \
+			*((volatile type *) (addr)) = (val); \
+		else \
+			omap4430_backend->write((val), (void *) (addr), \
+						sizeof(type)); \
+	} while (0)
+
+#define __readb(addr)		__read(uint8_t, addr)
+#define __writeb(val, addr)	__write(uint8_t, val, addr)
+#define __readw(addr)		__read(uint16_t, addr)
+#define __writew(val, addr)	__write(uint16_t, val, addr)
+#define __readl(addr)		__read(uint32_t, addr)
+#define __writel(val, addr)	__write(uint32_t, val, addr)
 
 #define GLOBAL_TIMEOUT	100
 
+void omap4430_set_backend(const struct omap4430_backend_t *backend);
+
+void omap4430_read_words(uint32_t *dst, void *addr, size_t count);
+
+void omap4430_op_account(const char *op, unsigned long reads,
+			 unsigned long writes);
+
+void omap4430_op_report(FILE *f);
+
 void *map_region(uint32_t hw_addr, size_t size);
 
 void *map_page(uint32_t hw_addr);
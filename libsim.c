@@ -0,0 +1,585 @@
+/*
+ * Copyright (C) 2013 - Adrien Vergé <adrienverge@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+
+#include "libomap4430.h"
+#include "libcsfmt.h"
+#include "libetb.h"
+#include "libstm.h"
+#include "libstp.h"
+#include "libsim.h"
+
+#define SIM_MAGIC	0x4d495354	/* "TSIM" */
+#define SIM_MAX_WINDOWS	16
+
+/* Device state, in the shared file */
+struct sim_state {
+	uint32_t magic;
+	pthread_mutex_t lock;
+
+	/* ETB */
+	uint32_t rrp, rwp;
+	uint32_t ctl, ffcr, trig;
+	uint32_t irst, ier;
+	int full;
+	uint64_t dropped;		/* words sent while capture is off */
+	struct csfmt_encoder_t fmt;	/* formatter, when FFCR enables it */
+
+	/* STM: what the encoder has not pushed to the ETB yet */
+	int channel;
+	uint8_t pending[4];
+	size_t pending_u4;
+	size_t since_sync;		/* bytes pushed since the last sync */
+	uint64_t last_ts;		/* cycles at the last timestamp */
+
+	uint32_t ram[SIM_ETB_DEPTH];
+};
+
+enum sim_kind {
+	SIM_PLAIN,
+	SIM_CM_EMU,
+	SIM_STM_CTL,
+	SIM_STM_XPORT,
+	SIM_ETB,
+};
+
+/* Register windows mapped by this process, backed by plain memory */
+struct sim_window {
+	void *vaddr;
+	size_t size;
+	enum sim_kind kind;
+};
+
+static struct sim_state *sim;
+static struct sim_window windows[SIM_MAX_WINDOWS];
+static struct stp_encoder_t enc;
+
+static void sim_lock(void)
+{
+	if (pthread_mutex_lock(&sim->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&sim->lock);
+}
+
+static void sim_unlock(void)
+{
+	pthread_mutex_unlock(&sim->lock);
+}
+
+static uint64_t sim_cycles(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * SIM_FREQ +
+	       (uint64_t) ts.tv_nsec * SIM_FREQ / 1000000000;
+}
+
+static int sim_init_state(struct sim_state *s)
+{
+	pthread_mutexattr_t attr;
+
+	memset(s, 0, sizeof(*s));
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (pthread_mutex_init(&s->lock, &attr)) {
+		fprintf(stderr, "error: couldn't create the device lock\n");
+		return -1;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	s->channel = -1;
+	s->last_ts = sim_cycles();
+	csfmt_encoder_init(&s->fmt);
+	s->magic = SIM_MAGIC;
+
+	return 0;
+}
+
+/*
+ * Maps the device state from the file at path, creating it if needed.
+ */
+int sim_attach(const char *path)
+{
+	int ret = -1;
+	int fd;
+	struct stat st;
+	struct sim_state *s;
+
+	if (sim != NULL)
+		return 0;
+
+	if (stp_encoder_init(&enc))
+		goto end;
+
+	fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		perror("open");
+		goto free_encoder;
+	}
+	/* The first process to attach initializes the state */
+	if (flock(fd, LOCK_EX)) {
+		perror("flock");
+		goto close_fd;
+	}
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		goto close_fd;
+	}
+	if (st.st_size != sizeof(*s) && ftruncate(fd, sizeof(*s))) {
+		perror("ftruncate");
+		goto close_fd;
+	}
+
+	s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (s == MAP_FAILED) {
+		perror("mmap");
+		goto close_fd;
+	}
+	if (st.st_size != sizeof(*s) || s->magic != SIM_MAGIC)
+		if (sim_init_state(s)) {
+			munmap(s, sizeof(*s));
+			goto close_fd;
+		}
+
+	sim = s;
+	ret = 0;
+
+close_fd:
+	/* The mapping keeps the lock otherwise */
+	flock(fd, LOCK_UN);
+	close(fd);
+free_encoder:
+	if (ret)
+		stp_encoder_free(&enc);
+end:
+	return ret;
+}
+
+/*
+ * ETB
+ */
+
+static void sim_etb_store(uint32_t word)
+{
+	sim->ram[sim->rwp] = word;
+	if (++sim->rwp == SIM_ETB_DEPTH) {
+		sim->rwp = 0;
+		sim->full = 1;
+		sim->irst |= TI_ETB_IRST_FULL;
+	} else if (sim->rwp == SIM_ETB_DEPTH / 2) {
+		sim->irst |= TI_ETB_IRST_HALF_FULL;
+	}
+}
+
+static void sim_etb_store_frames(const uint8_t *frames, size_t size)
+{
+	size_t k;
+
+	for (k = 0; k < size; k += 4)
+		sim_etb_store(frames[k] | frames[k + 1] << 8 |
+			      frames[k + 2] << 16 |
+			      (uint32_t) frames[k + 3] << 24);
+}
+
+/* A word from the STM, the only source on the ATB */
+static void sim_etb_push(uint32_t word)
+{
+	uint8_t bytes[4] = { word, word >> 8, word >> 16, word >> 24 };
+	uint8_t frames[CSFMT_ENCODE_MAX(4)];
+
+	if (!(sim->ctl & 1)) {
+		sim->dropped++;
+		return;
+	}
+
+	if (sim->ffcr & ETB_FFCR_ENFTC)
+		sim_etb_store_frames(frames,
+				     csfmt_encode(&sim->fmt, SIM_STM_ATB_ID,
+						  bytes, 4, frames));
+	else
+		sim_etb_store(word);
+}
+
+static int sim_etb_read(off_t offset, uint32_t *val)
+{
+	switch (offset) {
+	case ETB_RDP:
+		*val = SIM_ETB_DEPTH;
+		break;
+	case ETB_WIDTH:
+		*val = 32;
+		break;
+	case ETB_STS:
+		/* Full, AcqComp when stopped, FtEmpty */
+		*val = sim->full | (sim->ctl & 1 ? 0 : 1 << 2) | 1 << 3;
+		break;
+	case ETB_RRD:
+		*val = sim->ram[sim->rrp];
+		sim->rrp = (sim->rrp + 1) % SIM_ETB_DEPTH;
+		break;
+	case ETB_RRP:
+		*val = sim->rrp;
+		break;
+	case ETB_RWP:
+		*val = sim->rwp;
+		break;
+	case ETB_TRIG:
+		*val = sim->trig;
+		break;
+	case ETB_CTL:
+		*val = sim->ctl;
+		break;
+	case ETB_FFSR:
+		/* FtStopped */
+		*val = sim->ctl & 1 ? 0 : 1 << 1;
+		break;
+	case ETB_FFCR:
+		*val = sim->ffcr;
+		break;
+	case ETB_IRST:
+		*val = sim->irst;
+		break;
+	case ETB_IER:
+		*val = sim->ier;
+		break;
+	default:
+		if (offset >= ETB_RBD && offset < ETB_RBD + ETB_RBD_SIZE)
+			return sim_etb_read(ETB_RRD, val);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sim_etb_write(off_t offset, uint32_t val)
+{
+	switch (offset) {
+	case ETB_RRP:
+		sim->rrp = val % SIM_ETB_DEPTH;
+		break;
+	case ETB_RWP:
+		sim->rwp = val % SIM_ETB_DEPTH;
+		sim->full = 0;
+		/* Frames start over */
+		csfmt_encoder_init(&sim->fmt);
+		break;
+	case ETB_RWD:
+		sim->ram[sim->rwp] = val;
+		sim->rwp = (sim->rwp + 1) % SIM_ETB_DEPTH;
+		break;
+	case ETB_TRIG:
+		sim->trig = val;
+		break;
+	case ETB_CTL:
+		sim->ctl = val & 1;
+		break;
+	case ETB_FFCR:
+		/* A manual flush completes at once, padding the last frame */
+		if ((val & ETB_FFCR_FLUSHMAN) && (sim->ctl & 1)) {
+			uint8_t frame[CSFMT_FRAME_SIZE];
+
+			sim_etb_store_frames(frame,
+					     csfmt_encode_flush(&sim->fmt, frame));
+		}
+		sim->ffcr = val & ~ETB_FFCR_FLUSHMAN;
+		break;
+	case ETB_ICST:
+		sim->irst &= ~val;
+		break;
+	case ETB_IER:
+		sim->ier = val;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * STM
+ */
+
+/* Pushes the whole words written by the encoder to the ETB */
+static void sim_stm_push(void)
+{
+	size_t k, words = enc.u4len / 8;
+	uint8_t *p;
+
+	for (k = 0; k < words; k++) {
+		p = enc.buf + 4 * k;
+		sim_etb_push(p[0] | p[1] << 8 | p[2] << 16 |
+			     (uint32_t) p[3] << 24);
+	}
+	sim->since_sync += 4 * words;
+
+	sim->pending_u4 = enc.u4len % 8;
+	memcpy(sim->pending, enc.buf + 4 * words, sizeof(sim->pending));
+	sim->channel = enc.channel;
+}
+
+/*
+ * Ends the current block, so that it can be decoded.  The sync packet is
+ * padded to end on a word, so nothing is left pending after it.
+ */
+static void sim_stm_sync(void)
+{
+	if (stp_encode_pad(&enc, 4) || stp_encode_sync(&enc))
+		return;
+	sim_stm_push();
+	sim->since_sync = 0;
+}
+
+static void sim_stm_write(off_t offset, uint32_t val, int size)
+{
+	int channel = offset / STM_CHAN_RESOLUTION;
+	int ts = -1;
+	uint64_t now;
+
+	enc.u4len = sim->pending_u4;
+	memcpy(enc.buf, sim->pending, sizeof(sim->pending));
+	enc.channel = sim->channel;
+
+	if (offset % STM_CHAN_RESOLUTION >= STM_CHAN_RESOLUTION / 2) {
+		now = sim_cycles();
+		ts = now - sim->last_ts > INT32_MAX ?
+			INT32_MAX : (int) (now - sim->last_ts);
+		sim->last_ts = now;
+	}
+
+	if (stp_encode_write(&enc, channel, val, size, ts))
+		return;
+	if (ts >= 0 && sim->since_sync + enc.u4len / 2 >= SIM_SYNC_PERIOD)
+		sim_stm_sync();
+	else
+		sim_stm_push();
+}
+
+static void sim_stm_flush(void)
+{
+	if (sim->pending_u4 == 0 && sim->since_sync == 0)
+		return;
+
+	enc.u4len = sim->pending_u4;
+	memcpy(enc.buf, sim->pending, sizeof(sim->pending));
+	enc.channel = sim->channel;
+	sim_stm_sync();
+}
+
+static int sim_stm_ctl_read(void *reg, off_t offset, uint32_t *val)
+{
+	switch (offset) {
+	case STM_MIPI_REGOFF_SWMstCntl_0:
+		/* A claim is granted to the application at once */
+		*val = *(uint32_t *) reg;
+		if (*val & (1 << 30))
+			*val |= 1 << 28;
+		break;
+	case STM_MIPI_REGOFF_SysStatus:
+		/* Reading it is how stm_flush() waits for the FIFO */
+		sim_stm_flush();
+		*val = 1 << 8;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Backend
+ */
+
+static enum sim_kind sim_kind_of(uint32_t hw_addr)
+{
+	switch (hw_addr) {
+	case OMAP4430_CM_EMU:
+		return SIM_CM_EMU;
+	case STM_CONFIG:
+		return SIM_STM_CTL;
+	case STM_XPORT:
+		return SIM_STM_XPORT;
+	case CS_ETB:
+		return SIM_ETB;
+	default:
+		return SIM_PLAIN;
+	}
+}
+
+static void *sim_map_region(uint32_t hw_addr, size_t size)
+{
+	struct sim_window *w;
+	void *vaddr;
+
+	for (w = windows; w < windows + SIM_MAX_WINDOWS; w++)
+		if (w->vaddr == NULL)
+			break;
+	if (w == windows + SIM_MAX_WINDOWS) {
+		fprintf(stderr, "error: too many simulated windows\n");
+		return NULL;
+	}
+
+	vaddr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (vaddr == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	w->vaddr = vaddr;
+	w->size = size;
+	w->kind = sim_kind_of(hw_addr);
+
+	return vaddr;
+}
+
+static struct sim_window *sim_find_window(void *addr)
+{
+	struct sim_window *w;
+
+	for (w = windows; w < windows + SIM_MAX_WINDOWS; w++)
+		if (w->vaddr != NULL && addr >= w->vaddr &&
+		    addr < w->vaddr + w->size)
+			return w;
+
+	return NULL;
+}
+
+/* The size given may not be the mapped one, see stm_close() */
+static void sim_unmap_region(void *vaddr, size_t size)
+{
+	struct sim_window *w = sim_find_window(vaddr);
+
+	if (w == NULL)
+		return;
+	munmap(w->vaddr, w->size);
+	w->vaddr = NULL;
+}
+
+/* Called with the lock held */
+static uint32_t sim_read_window(struct sim_window *w, void *addr, int size)
+{
+	off_t offset = addr - w->vaddr;
+	uint32_t val = 0;
+	int ret = -1;
+
+	switch (w->kind) {
+	case SIM_ETB:
+		ret = sim_etb_read(offset, &val);
+		break;
+	case SIM_STM_CTL:
+		ret = sim_stm_ctl_read(addr, offset, &val);
+		break;
+	case SIM_CM_EMU:
+		/* Clocks are always on */
+		if (offset == 0xA00) {
+			val = *(uint32_t *) addr | 0x300;
+			ret = 0;
+		} else if (offset == 0xA20) {
+			val = *(uint32_t *) addr | 0x40000;
+			ret = 0;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (ret)
+		memcpy(&val, addr, size);
+
+	return val;
+}
+
+static uint32_t sim_read(void *addr, int size)
+{
+	struct sim_window *w = sim_find_window(addr);
+	uint32_t val;
+
+	if (w == NULL) {
+		fprintf(stderr, "error: read at unmapped address %p\n", addr);
+		return 0;
+	}
+
+	sim_lock();
+	val = sim_read_window(w, addr, size);
+	sim_unlock();
+
+	return val;
+}
+
+/* A burst is one transaction: the lock is taken once */
+static void sim_read_words(uint32_t *dst, void *addr, size_t count)
+{
+	struct sim_window *w = sim_find_window(addr);
+	size_t k;
+
+	if (w == NULL || addr + 4 * count > w->vaddr + w->size) {
+		fprintf(stderr, "error: read at unmapped address %p\n", addr);
+		return;
+	}
+
+	sim_lock();
+	for (k = 0; k < count; k++)
+		dst[k] = sim_read_window(w, addr + 4 * k, 4);
+	sim_unlock();
+}
+
+static void sim_write(uint32_t val, void *addr, int size)
+{
+	struct sim_window *w = sim_find_window(addr);
+	off_t offset;
+	int ret = -1;
+
+	if (w == NULL) {
+		fprintf(stderr, "error: write at unmapped address %p\n", addr);
+		return;
+	}
+	offset = addr - w->vaddr;
+
+	sim_lock();
+	switch (w->kind) {
+	case SIM_ETB:
+		ret = sim_etb_write(offset, val);
+		break;
+	case SIM_STM_XPORT:
+		sim_stm_write(offset, val, size);
+		ret = 0;
+		break;
+	default:
+		break;
+	}
+	sim_unlock();
+
+	if (ret)
+		memcpy(addr, &val, size);
+}
+
+const struct omap4430_backend_t sim_backend = {
+	.map_region = sim_map_region,
+	.unmap_region = sim_unmap_region,
+	.read = sim_read,
+	.write = sim_write,
+	.read_words = sim_read_words,
+};
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2013 - Adrien Vergé <adrienverge@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <signal.h>
+#ifndef LIBSIM_H
+#define LIBSIM_H
+
+#include <stdint.h>
+
+#include "libomap4430.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Simulated STM and ETB, for running the programs without an OMAP4430.
+ *
+ * Writes to the STM stimulus ports are encoded into STP (see the encoder of
+ * libstp) and appended to the ETB RAM while capture is enabled, with a sync
+ * packet every SIM_SYNC_PERIOD bytes and on stm_flush().  The ETB has the
+ * RRP, RWP, RRD, RDP, CTL and STS semantics of the real one: RWP wraps
+ * around the RAM and sets the full flag, and reading RRD, or the TI burst
+ * read window, advances RRP.  The TI full and half-full raw interrupt
+ * status bits are raised when RWP wraps and reaches the middle of the RAM,
+ * and cleared by writing them to ICST.  When FFCR enables the formatter,
+ * the STM stream is stored in CoreSight frames (see libcsfmt), with ID
+ * SIM_STM_ATB_ID.
+ * Other registers read back what was written, except for those that the
+ * libraries poll.
+ *
+ * The device state is kept in a file, shared by all the processes that
+ * attach to it, so that stmwrite and etbread can run at the same time.
+ * libomap4430 attaches to the file named by the SIM_ENV environment
+ * variable, if set.
+ */
+#define SIM_ENV			"OMAP4430_SIM"
+#define SIM_ETB_DEPTH		0x800	/* ETB RAM words */
+#define SIM_SYNC_PERIOD		1024	/* bytes between sync packets */
+#define SIM_FREQ		133400000	/* timestamp clock, in Hz */
+#define SIM_STM_ATB_ID		0x20
+
+extern const struct omap4430_backend_t sim_backend;
+
+int sim_attach(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -21,6 +21,7 @@
 
 int stm_open(struct stm_handle_t *stm_handle)
 {
+	stm_handle->unlocked = 0;
 	stm_handle->base_ctl = map_page(STM_CONFIG);
 	if (stm_handle->base_ctl == NULL)
 		return -1;
@@ -38,17 +39,54 @@ int stm_open(struct stm_handle_t *stm_handle)
 
 void stm_close(struct stm_handle_t *stm_handle)
 {
+	if (stm_handle->unlocked > 0)
+		coresight_lock(stm_handle->base_ctl);
 	unmap_page(stm_handle->base_ctl);
 	stm_handle->base_ctl = NULL;
 	unmap_page(stm_handle->base_xport);
 	stm_handle->base_xport = NULL;
 }
 
+/*
+ * The control registers are unlocked by the outermost of nested calls, and
+ * locked again when it returns.
+ */
+static void stm_unlock(struct stm_handle_t *stm_handle)
+{
+	if (stm_handle->unlocked++ == 0)
+		coresight_unlock(stm_handle->base_ctl);
+}
+
+static void stm_lock(struct stm_handle_t *stm_handle)
+{
+	if (--stm_handle->unlocked == 0)
+		coresight_lock(stm_handle->base_ctl);
+}
+
+/*
+ * Keeps the control registers unlocked until the matching stm_end(), for a
+ * sequence of calls that would otherwise unlock and lock them each.
+ */
+void stm_begin(struct stm_handle_t *stm_handle)
+{
+	OMAP4430_OP_START();
+	stm_unlock(stm_handle);
+	OMAP4430_OP_END();
+}
+
+void stm_end(struct stm_handle_t *stm_handle)
+{
+	OMAP4430_OP_START();
+	stm_lock(stm_handle);
+	OMAP4430_OP_END();
+}
+
 int stm_config_for_etb(struct stm_handle_t *stm_handle)
 {
 	int ret = -1;
 	void *base_tf;
 	int timeout = GLOBAL_TIMEOUT;
+	OMAP4430_OP_START();
 
 	base_tf = map_page(CS_TF_DEBUGSS);
 	if (base_tf == NULL)
@@ -59,7 +97,7 @@ int stm_config_for_etb(struct stm_handle_t *stm_handle)
 	__writel(__readl(base_tf + 0)|(1<<7), base_tf + 0);
 	coresight_lock(base_tf);
 
-	coresight_unlock(stm_handle->base_ctl);
+	stm_unlock(stm_handle);
 
 	// In some cases the STM module can transport a SYNC message
 	// thus the reason the ETB must be setup first.
@@ -110,10 +148,11 @@ int stm_config_for_etb(struct stm_handle_t *stm_handle)
 	ret = 0;
 
 relock_cs:
-	coresight_lock(stm_handle->base_ctl);
+	stm_lock(stm_handle);
 
 	unmap_page(base_tf);
 end:
+	OMAP4430_OP_END();
 	return ret;
 }
 
@@ -121,8 +160,9 @@ int stm_flush(struct stm_handle_t *stm_handle)
 {
 	int ret = -1;
 	int timeout = STM_FLUSH_RETRY;
+	OMAP4430_OP_START();
 
-	coresight_unlock(stm_handle->base_ctl);
+	stm_unlock(stm_handle);
 
 	while (--timeout)
 		if ((stm_ctl_read_reg(stm_handle, 0x014) & (1<<8)) == (1<<8)) {
@@ -130,7 +170,8 @@ int stm_flush(struct stm_handle_t *stm_handle)
 			break;
 		}
 
-	coresight_lock(stm_handle->base_ctl);
+	stm_lock(stm_handle);
 
+	OMAP4430_OP_END();
 	return ret;
 }
@@ -91,12 +91,17 @@ extern "C" {
 
 struct stm_handle_t {
 	void *base_ctl, *base_xport;
+	int unlocked;		/* nested sessions, see stm_begin() */
 };
 
 int stm_open(struct stm_handle_t *stm_handle);
 
 void stm_close(struct stm_handle_t *stm_handle);
 
+void stm_begin(struct stm_handle_t *stm_handle);
+
+void stm_end(struct stm_handle_t *stm_handle);
+
 int stm_config_for_etb(struct stm_handle_t *stm_handle);
 
 int stm_flush(struct stm_handle_t *stm_handle);
@@ -115,7 +120,7 @@ static inline void stm_send_u32_pkt(struct stm_handle_t *stm_handle,
 				    int channel, uint32_t data)
 {
 	stm_xport_writel(stm_handle, data, channel);
-	stm_xport_ts_writeb(stm_handle, 8, channel);
+	stm_xport_ts_writeb(stm_handle, 4, channel);	/* packet length */
 }
 
 static inline ssize_t stm_send_msg_pkt(struct stm_handle_t *stm_handle,
@@ -16,19 +16,33 @@
  */
 
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "libstp.h"
 #include "libstm.h"
 
-#define halfbyte(src, pos) \
-	(((pos)%2)?((src[(pos)/2]>>4)&0xf):(src[(pos)/2]&0xf))
-#define byteat(src, pos) \
-	(((pos)%2) ? \
-		(((halfbyte(src, (pos))<<0) | \
-		 (halfbyte(src, (pos)+1)<<4)) & 0xff) : \
-		src[(pos)/2]&0xff )
+/*
+ * Decoding works on a nibble stream (one nibble per byte, low nibble of each
+ * input byte first), see stp_unpack_nibbles().
+ */
+#define byteat(nib, pos) \
+	((nib)[(pos)] | ((nib)[(pos)+1] << 4))
 
 enum stp_msg_format {
 	STP_MASTER = 0x1,
@@ -39,18 +53,28 @@ enum stp_msg_format {
 	STP_D32 = 0x6, STP_D32TS = 0xa
 };
 
-#define STP_MSG_IS_CHANNEL(msg_type) \
-	((msg_type)==STP_C8)
-#define STP_MSG_IS_DATA(msg_type) \
-	((msg_type)==STP_D8||(msg_type)==STP_D16||(msg_type)==STP_D32|| \
-	 (msg_type)==STP_D8TS||(msg_type)==STP_D16TS||(msg_type)==STP_D32TS)
-#define STP_MSG_IS_TIMESTAMPED(msg_type) \
-	((msg_type)==STP_D8TS||(msg_type)==STP_D16TS||(msg_type)==STP_D32TS)
-#define STRINGIFY_STP_TYPE(v) \
-	v==STP_MASTER?"STP_MASTER":v==STP_OVRF?"STP_OVRF":v==STP_C8?"STP_C8":v\
-	==STP_D8?"STP_D8":v==STP_D8TS?"STP_D8TS":v==STP_D16?"STP_D16":v==\
-	STP_D16TS?"STP_D16TS":v==STP_D32?"STP_D32":v==STP_D32TS?"STP_D32TS":\
-	"(unknown)"
+/*
+ * Lengths (in nibbles) of the data field of each message type, and whether it
+ * is preceded by a timestamp.  A zero data_len means an invalid type.
+ */
+#define STP_MSG_F_DATA		(1 << 0)
+#define STP_MSG_F_TS		(1 << 1)
+#define STP_MSG_F_CHANNEL	(1 << 2)
+
+static const struct stp_msg_desc {
+	uint8_t data_len;
+	uint8_t flags;
+} stp_msg_table[16] = {
+	[STP_MASTER] = { 2, 0 },
+	[STP_OVRF]   = { 2, 0 },
+	[STP_C8]     = { 2, STP_MSG_F_CHANNEL },
+	[STP_D8]     = { 2, STP_MSG_F_DATA },
+	[STP_D16]    = { 4, STP_MSG_F_DATA },
+	[STP_D32]    = { 8, STP_MSG_F_DATA },
+	[STP_D8TS]   = { 2, STP_MSG_F_DATA | STP_MSG_F_TS },
+	[STP_D16TS]  = { 4, STP_MSG_F_DATA | STP_MSG_F_TS },
+	[STP_D32TS]  = { 8, STP_MSG_F_DATA | STP_MSG_F_TS },
+};
 
 /*
  * Packet layout :
@@ -82,259 +106,598 @@ enum stp_msg_format {
  * of type 6 or a contains the real size.
  */
 
+/*
+ * Frees a list of packets that were not allocated from an arena.
+ */
 void free_stp_pkt_list(struct stp_pkt *list)
 {
-	if (list->next != NULL)
-		free_stp_pkt_list(list->next);
-	free(list);
+	struct stp_pkt *next;
+
+	for (; list != NULL; list = next) {
+		next = list->next;
+		free(list);
+	}
+}
+
+/*
+ * Arena allocator
+ *
+ * Memory is carved from large slabs and never freed individually.  Resetting
+ * the arena releases everything at once, and keeps the slabs for the next
+ * allocations.
+ */
+struct stp_arena_slab {
+	struct stp_arena_slab *next;
+	size_t size;
+	char data[];
+};
+
+#define STP_ARENA_ALIGN(size) \
+	(((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+int stp_arena_init(struct stp_arena_t *arena, size_t slab_size)
+{
+	arena->first = arena->slab = NULL;
+	arena->used = 0;
+	arena->slab_size = slab_size ? slab_size : STP_ARENA_SLAB_SIZE;
+
+	return 0;
 }
 
-static struct stp_pkt *new_stp_pkt(char *data, size_t len, int timestamp)
+static void *stp_arena_alloc(struct stp_arena_t *arena, size_t size)
 {
-	struct stp_pkt *pkt;
+	struct stp_arena_slab *slab, **link;
+	void *ptr;
+
+	size = STP_ARENA_ALIGN(size);
+
+	if (arena->slab == NULL || arena->used + size > arena->slab->size) {
+		/* Reuse the next slab if big enough, or insert a new one */
+		link = arena->slab ? &arena->slab->next : &arena->first;
+
+		if (*link == NULL || (*link)->size < size) {
+			slab = malloc(sizeof(struct stp_arena_slab) +
+				      (size > arena->slab_size ?
+				       size : arena->slab_size));
+			if (slab == NULL) {
+				perror("malloc");
+				return NULL;
+			}
+			slab->size = size > arena->slab_size ?
+				     size : arena->slab_size;
+			slab->next = *link;
+			*link = slab;
+		}
 
-	pkt = malloc(sizeof(struct stp_pkt));
-	if (pkt == NULL) {
-		perror("malloc");
-		return NULL;
+		arena->slab = *link;
+		arena->used = 0;
 	}
 
-	pkt->data = malloc(len);
-	if (pkt->data == NULL) {
-		perror("malloc");
-		free(pkt);
-		return NULL;
+	ptr = &arena->slab->data[arena->used];
+	arena->used += size;
+
+	return ptr;
+}
+
+void stp_arena_reset(struct stp_arena_t *arena)
+{
+	arena->slab = NULL;
+	arena->used = 0;
+}
+
+void stp_arena_destroy(struct stp_arena_t *arena)
+{
+	struct stp_arena_slab *slab, *next;
+
+	for (slab = arena->first; slab != NULL; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+
+	arena->first = arena->slab = NULL;
+	arena->used = 0;
+}
+
+/*
+ * The payload is allocated along with the packet, from the arena if any.
+ */
+static struct stp_pkt *new_stp_pkt(size_t len, int timestamp,
+				   struct stp_arena_t *arena)
+{
+	struct stp_pkt *pkt;
+
+	if (arena != NULL) {
+		pkt = stp_arena_alloc(arena, sizeof(struct stp_pkt) + len);
+		if (pkt == NULL)
+			return NULL;
+	} else {
+		pkt = malloc(sizeof(struct stp_pkt) + len);
+		if (pkt == NULL) {
+			perror("malloc");
+			return NULL;
+		}
 	}
 
+	pkt->next = NULL;
+	pkt->data = (char *) &pkt[1];
 	pkt->timestamp = timestamp;
 	pkt->len = len;
 	pkt->channel = 0xff;
+	pkt->master = 0xff;
 
 	return pkt;
 }
 
 /*
- * Takes an ETB buffer and find packets inside.
- * Returns a linked-list of struct stp_pkt.
+ * Splits u8size bytes into 2 * u8size nibbles, low nibble first.
+ */
+static void stp_unpack_nibbles(uint8_t *nib, const char *in, size_t u8size)
+{
+	const uint8_t *src = (const uint8_t *) in;
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	for (; i + 32 <= u8size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) &src[i]);
+		__m256i lo = _mm256_and_si256(v, mask);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+		/* unpack works on 128-bit lanes, put them back in order */
+		__m256i a = _mm256_unpacklo_epi8(lo, hi);
+		__m256i b = _mm256_unpackhi_epi8(lo, hi);
+
+		_mm256_storeu_si256((__m256i *) &nib[2 * i],
+				    _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *) &nib[2 * i + 32],
+				    _mm256_permute2x128_si256(a, b, 0x31));
+	}
+#elif defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi8(0x0f);
+
+	for (; i + 16 <= u8size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &src[i]);
+		__m128i lo = _mm_and_si128(v, mask);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+
+		_mm_storeu_si128((__m128i *) &nib[2 * i],
+				 _mm_unpacklo_epi8(lo, hi));
+		_mm_storeu_si128((__m128i *) &nib[2 * i + 16],
+				 _mm_unpackhi_epi8(lo, hi));
+	}
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+	const uint8x16_t mask = vdupq_n_u8(0x0f);
+
+	for (; i + 16 <= u8size; i += 16) {
+		uint8x16_t v = vld1q_u8(&src[i]);
+		uint8x16x2_t out;
+
+		out.val[0] = vandq_u8(v, mask);
+		out.val[1] = vshrq_n_u8(v, 4);
+		/* interleaving store: lo0 hi0 lo1 hi1 ... */
+		vst2q_u8(&nib[2 * i], out);
+	}
+#endif
+
+	for (; i < u8size; i++) {
+		nib[2 * i] = src[i] & 0xf;
+		nib[2 * i + 1] = src[i] >> 4;
+	}
+}
+
+/*
+ * Scratch buffer holding the nibble stream of one block at a time, so that it
+ * stays in cache.  The stream is preceded by one zero nibble, so that looking
+ * one nibble before the first message is harmless.
+ */
+struct stp_nibbles {
+	uint8_t *buf;
+	size_t size;
+};
+
+static uint8_t *stp_nibbles_unpack(struct stp_nibbles *nb,
+				   const char *in, size_t u8size)
+{
+	uint8_t *buf;
+
+	if (nb->size < 2 * u8size + 1) {
+		buf = realloc(nb->buf, 2 * u8size + 1);
+		if (buf == NULL) {
+			perror("realloc");
+			return NULL;
+		}
+		nb->buf = buf;
+		nb->size = 2 * u8size + 1;
+	}
+
+	nb->buf[0] = 0;
+	stp_unpack_nibbles(&nb->buf[1], in, u8size);
+
+	return &nb->buf[1];
+}
+
+static void stp_nibbles_release(struct stp_nibbles *nb)
+{
+	free(nb->buf);
+	nb->buf = NULL;
+	nb->size = 0;
+}
+
+/*
+ * Decoding core
  *
- * The input buffer is read from the end to the beginning.
+ * A block is decoded in two passes over its nibble stream.  Since messages end
+ * with their type, the first pass frames them from the end of the block.  It
+ * stores the length of each message in the spare bits of its first nibble,
+ * and flags the last message of each packet.  The second pass walks the
+ * messages in chronological order and calls the visitor, without any
+ * allocation.
  */
-struct stp_pkt *stp_read_pkts(char *in, size_t u8size)
+#define STP_NIB_PKT_END		0x10
+#define STP_NIB_LEN_SHIFT	4
+
+#define mbyteat(nib, pos) \
+	(((nib)[(pos)] & 0xf) | (((nib)[(pos)+1] & 0xf) << 4))
+
+/*
+ * Decodes the timestamp of a message starting at nibble p, whose data starts
+ * at nibble d.
+ */
+static inline int stp_decode_ts(const uint8_t *nib, off_t p, off_t d)
 {
-	size_t u4size = 2 * u8size;
-	off_t i, j;
-	enum stp_msg_format msg_type;
-	ssize_t pkt_len, msg_len, data_len;
-	int timestamp;
-	uint32_t data;
+	int hb0, b1;
 
-	struct stp_pkt *pkt = NULL, *pkt_list = NULL;
-	off_t pkt_offset = 0;
+	if (d - p != 4)
+		return mbyteat(nib, p);
 
-	if (halfbyte(in, u4size - 1) == 0)
-		u4size--;
+	hb0 = nib[p] & 0xf;
+	b1 = mbyteat(nib, p + 2);
+	if (hb0 < 7)
+		return (1 << (7 + hb0)) + ((b1 ^ 0x80) << (hb0));
+	else
+		return (1 << hb0) + (b1 << (2 * hb0 - 6));
+}
 
-#if defined(DEBUG)
-	for (i = 0; i < u4size; i++)
-		fprintf(stderr, "%x ", halfbyte(in, i));
-	fprintf(stderr, "\n");
-#endif
+/*
+ * First pass: frames messages from the end to the beginning.
+ * Returns the position of the first framed nibble.  Nibbles before it could
+ * not be framed, *err tells why.
+ */
+static off_t stp_frame_nibbles(uint8_t *nib, size_t u4size,
+			       struct stp_visitor_t *v, int *err, int *ret)
+{
+	off_t i, lo = u4size;
+	enum stp_msg_format msg_type;
+	const struct stp_msg_desc *desc;
+	ssize_t pkt_len, msg_len, data_len;
+	off_t pkt_offset = 0;
+	int unordered = (v->flags & STP_VISIT_UNORDERED) && v->on_packet &&
+			v->filter == NULL;
 
+	*err = 0;
+	*ret = 0;
 	i = u4size - 1;
 
 	while (i > 0) {
-		msg_type = halfbyte(in, i);
-
-		switch (msg_type) {
-		case STP_MASTER:
-		case STP_OVRF:
-		case STP_C8:
-		case STP_D8:
-		case STP_D8TS:
-			data_len = 2;
-			break;
-		case STP_D16:
-		case STP_D16TS:
-			data_len = 4;
-			break;
-		case STP_D32:
-		case STP_D32TS:
-			data_len = 8;
+		msg_type = nib[i];
+		desc = &stp_msg_table[msg_type];
+		data_len = desc->data_len;
+
+		if (data_len == 0) {
+			*err = STP_ERR_UNKNOWN_MSG;
 			break;
-		default:
-			data_len = 0;
-			fprintf(stderr, "ERROR: unknown STP message type: %x",
-				msg_type);
-			goto end;
 		}
 
 		if (i - data_len < 0 ||
-		    (STP_MSG_IS_TIMESTAMPED(msg_type) && i - data_len - 2 < 0)) {
-			fprintf(stderr, "ERROR: %s packet truncated at the "
-				"beggining of buffer\n",
-				STRINGIFY_STP_TYPE(msg_type));
-			goto end;
+		    ((desc->flags & STP_MSG_F_TS) && i - data_len - 2 < 0)) {
+			*err = STP_ERR_TRUNCATED;
+			break;
 		}
 
 		msg_len = data_len;
-		if (STP_MSG_IS_TIMESTAMPED(msg_type)) {
+		if (desc->flags & STP_MSG_F_TS) {
 			msg_len += 2;
-			if (halfbyte(in, i - msg_len - 1) == 0xe) {
-				int hb0, b1;
+			if (nib[i - msg_len - 1] == 0xe)
 				msg_len += 2;
-				hb0 = halfbyte(in, i - msg_len),
-				b1 = byteat(in, i - msg_len + 2);
-				if (hb0 < 7)
-					timestamp = (1 << (7 + hb0)) + ((b1 ^ 0x80) << (hb0));
-				else
-					timestamp = (1 << hb0) + (b1 << (2 * hb0 - 6));
-			} else {
-				timestamp = byteat(in, i - msg_len);
-			}
-		}
-
-		data = 0;
-		for (j = data_len - 2; j >= 0; j -= 2) {
-			data = data << 8;
-			data |= byteat(in, i - data_len + j);
 		}
 
-		if (STP_MSG_IS_DATA(msg_type)) {
+		/*
+		 * Packets are read from their last message, whose last data
+		 * byte is the packet length.
+		 */
+		if (desc->flags & STP_MSG_F_DATA) {
 			if (pkt_offset <= 0) {
-				pkt_len = data >> (4 * (data_len - 2));
+				pkt_len = byteat(nib, i - 2);
 
 				if (2 * i - pkt_len < 0) {
-					fprintf(stderr, "ERROR: packet "
-						"overflowing on left\n");
-					goto end;
-				}
-
-				pkt = new_stp_pkt(NULL, pkt_len, timestamp);
-				if (pkt == NULL) {
-					fprintf(stderr, "ERROR: pkt == NULL\n");
-					goto end;
+					*err = STP_ERR_OVERFLOW_LEFT;
+					break;
 				}
-				pkt_offset = pkt_len;
 
-				pkt->next = pkt_list;
-				pkt_list = pkt;
+				/* Counting visitors need nothing more */
+				if (unordered &&
+				    (*ret = v->on_packet(v->ctx, NULL, pkt_len,
+					(desc->flags & STP_MSG_F_TS) ?
+					stp_decode_ts(nib, i - msg_len, i - data_len) : 0)))
+					return i - msg_len;
 
+				nib[i] |= STP_NIB_PKT_END;
+				pkt_offset = pkt_len;
 				data_len -= 2;
 			}
-
 			pkt_offset -= data_len / 2;
-			if (data_len == 2) // 1 byte
-				*((uint8_t *) &pkt->data[pkt_offset])
-					= data;
-			else if (data_len == 4) // 2 bytes
-				*((uint16_t *) &pkt->data[pkt_offset])
-					= (uint16_t) data;
-			else if (data_len == 6) { // 3 bytes
-				*((uint16_t *) &pkt->data[pkt_offset + 1])
-					= (uint16_t) (data >> 8);
-				*((uint8_t *) &pkt->data[pkt_offset])
-					= (uint8_t) data;
-			} else if (data_len == 8) // 4 bytes
-				*((uint32_t *) &pkt->data[pkt_offset])
-					= (uint32_t) data;
-		} else if (STP_MSG_IS_CHANNEL(msg_type)) {
-			if (pkt != NULL)
-				pkt->channel = data;
-#if defined(DEBUG)
-		} else {
-			fprintf(stderr, "%-10s: ", STRINGIFY_STP_TYPE(msg_type));
-			fprintf(stderr, "%x\n", data);
-#endif
 		}
 
+		lo = i - msg_len;
+		nib[lo] |= msg_len << STP_NIB_LEN_SHIFT;
 		i -= (msg_len + 1);
 	}
 
-end:
-	return pkt_list;
+	return lo;
 }
 
-size_t stp_count_pkts(char *in, size_t u8size)
+/*
+ * Gathers the data bytes of the messages between nibbles from and to, which
+ * are not the last of their packet.
+ */
+static size_t stp_collect_data(const uint8_t *nib, off_t from, off_t to,
+			       char *acc)
+{
+	const struct stp_msg_desc *desc;
+	size_t acc_len = 0, k;
+	off_t q;
+
+	for (; from < to; from = q + 1) {
+		q = from + (nib[from] >> STP_NIB_LEN_SHIFT);
+		desc = &stp_msg_table[nib[q] & 0xf];
+		if (!(desc->flags & STP_MSG_F_DATA))
+			continue;
+		for (k = 0; k < desc->data_len / 2 &&
+		     acc_len < STP_PKT_MAX_LEN + 8; k++)
+			acc[acc_len++] = mbyteat(nib, q - desc->data_len + 2 * k);
+	}
+
+	return acc_len;
+}
+
+/*
+ * Second pass: decodes the framed messages of a block.
+ * in points to the bytes of the block (payloads of single-message packets
+ * are passed from there without copy), and in_off is their offset in the
+ * caller's buffer, used to report errors.
+ */
+static int stp_visit_nibbles(uint8_t *nib, size_t u4size, const char *in,
+			     off_t in_off, struct stp_visitor_t *v)
 {
-	size_t u4size = 2 * u8size;
-	off_t i;
+	char acc[STP_PKT_MAX_LEN + 8];	/* payload being assembled */
+	size_t acc_len = 0;
 	enum stp_msg_format msg_type;
-	ssize_t pkt_len, msg_len, data_len;
+	const struct stp_msg_desc *desc;
+	off_t p, q, d, lo;
+	size_t pkt_len, n, k;
+	int err, timestamp, ret;
+	const char *payload;
+	uint8_t data;
+	struct stp_filter_t *f = v->filter;
+	int skip = f != NULL && !stp_filter_match(f, f->channel);
+	off_t pkt_start = -1;	/* first message of a skipped packet */
+
+	if (u4size == 0)
+		return 0;
+
+	if (nib[u4size - 1] == 0)
+		u4size--;
 
-	off_t pkt_offset = 0;
+#if defined(DEBUG)
+	for (p = 0; p < u4size; p++)
+		fprintf(stderr, "%x ", nib[p]);
+	fprintf(stderr, "\n");
+#endif
 
-	size_t count = 0;
+	lo = stp_frame_nibbles(nib, u4size, v, &err, &ret);
+	if (ret)
+		return ret;
 
-	if (halfbyte(in, u4size - 1) == 0)
-		u4size--;
+	if (err && v->on_error &&
+	    (ret = v->on_error(v->ctx, err, in_off + (lo > 0 ? lo - 1 : 0) / 2)))
+		return ret;
 
-	i = u4size - 1;
+	if ((v->flags & STP_VISIT_UNORDERED) && f == NULL)
+		return 0;
 
-	while (i > 0) {
-		msg_type = halfbyte(in, i);
-
-		switch (msg_type) {
-		case STP_MASTER:
-		case STP_OVRF:
-		case STP_C8:
-		case STP_D8:
-		case STP_D8TS:
-			data_len = 2;
-			break;
-		case STP_D16:
-		case STP_D16TS:
-			data_len = 4;
-			break;
-		case STP_D32:
-		case STP_D32TS:
-			data_len = 8;
-			break;
-		default:
-			data_len = 0;
-			fprintf(stderr, "ERROR: unknown STP message type: %x",
-				msg_type);
-			goto end;
+	for (p = lo; p < (off_t) u4size; p = q + 1) {
+		q = p + (nib[p] >> STP_NIB_LEN_SHIFT);
+
+		msg_type = nib[q] & 0xf;
+		desc = &stp_msg_table[msg_type];
+		d = q - desc->data_len;	/* first data nibble */
+
+		if (!(desc->flags & STP_MSG_F_DATA)) {
+			data = mbyteat(nib, d);
+			ret = 0;
+			if (msg_type == STP_C8 && f != NULL && data != 0xff) {
+				f->channel = data;
+				skip = !stp_filter_match(f, data);
+			}
+			if (msg_type == STP_C8 && v->on_channel)
+				ret = v->on_channel(v->ctx, data);
+			else if (msg_type == STP_MASTER && v->on_master)
+				ret = v->on_master(v->ctx, data);
+			else if (msg_type == STP_OVRF && v->on_overflow)
+				ret = v->on_overflow(v->ctx, data);
+			if (ret)
+				return ret;
+			continue;
 		}
 
-		if (i - data_len < 0 ||
-		    (STP_MSG_IS_TIMESTAMPED(msg_type) && i - data_len - 2 < 0)) {
-			fprintf(stderr, "ERROR: %s packet truncated at the "
-				"beggining of buffer\n",
-				STRINGIFY_STP_TYPE(msg_type));
-			goto end;
+		n = desc->data_len / 2;
+
+		if (!(nib[q] & STP_NIB_PKT_END)) {
+			/* Beginning of a packet */
+			if (skip) {
+				if (pkt_start < 0)
+					pkt_start = p;
+				continue;
+			}
+			if (!(v->flags & STP_VISIT_NO_PAYLOAD))
+				for (k = 0; k < n && acc_len < sizeof(acc); k++)
+					acc[acc_len++] = mbyteat(nib, d + 2 * k);
+			continue;
 		}
 
-		msg_len = data_len;
-		if (STP_MSG_IS_TIMESTAMPED(msg_type)) {
-			msg_len += 2;
-			if (halfbyte(in, i - msg_len - 1) == 0xe)
-				msg_len += 2;
+		timestamp = 0;
+		if (desc->flags & STP_MSG_F_TS)
+			timestamp = stp_decode_ts(nib, p, d);
+
+		/* Last message: its last data byte is the packet length */
+		n--;
+		pkt_len = mbyteat(nib, d + 2 * n);
+
+		/*
+		 * Packets on excluded channels are not assembled, but time
+		 * sync packets are always reported, for time to be rebuilt.
+		 */
+		if (skip) {
+			if (pkt_len != STP_TIME_SYNC_LEN ||
+			    (v->flags & STP_VISIT_NO_PAYLOAD)) {
+				f->skipped_ts += timestamp;
+				f->skipped++;
+				pkt_start = -1;
+				acc_len = 0;
+				continue;
+			}
+			acc_len = stp_collect_data(nib, pkt_start < 0 ? p :
+						   pkt_start, p, acc);
+			pkt_start = -1;
 		}
 
-		if (STP_MSG_IS_DATA(msg_type)) {
-			if (pkt_offset <= 0) {
-				pkt_len = byteat(in, i - 2);
+		if (v->flags & STP_VISIT_NO_PAYLOAD) {
+			payload = NULL;
+		} else if (acc_len == 0 && pkt_len == n && d % 2 == 0) {
+			payload = &in[d / 2];
+		} else {
+			for (k = 0; k < n && acc_len < sizeof(acc); k++)
+				acc[acc_len++] = mbyteat(nib, d + 2 * k);
 
-				if (2 * i - pkt_len < 0) {
-					fprintf(stderr, "ERROR: packet "
-						"overflowing on left\n");
-					goto end;
-				}
+			/* Keep the last pkt_len bytes, the packet may be
+			 * truncated at the beginning of the block */
+			if (acc_len >= pkt_len) {
+				payload = &acc[acc_len - pkt_len];
+			} else {
+				memmove(&acc[pkt_len - acc_len], acc, acc_len);
+				memset(acc, 0, pkt_len - acc_len);
+				payload = acc;
+			}
+		}
+		acc_len = 0;
 
-				count++;
+		if (skip && !stp_is_time_sync(payload, pkt_len)) {
+			f->skipped_ts += timestamp;
+			f->skipped++;
+			continue;
+		}
 
-				pkt_offset = pkt_len;
+		if (f != NULL && f->skipped > 0) {
+			/* Skipped packets may have hidden channel changes */
+			if (f->channel != 0xff && v->on_channel &&
+			    (ret = v->on_channel(v->ctx, f->channel)))
+				return ret;
+			timestamp += f->skipped_ts;
+			f->skipped_ts = 0;
+			f->skipped = 0;
+		}
 
-				data_len -= 2;
-			}
-			pkt_offset -= data_len / 2;
+		if (v->on_packet &&
+		    (ret = v->on_packet(v->ctx, payload, pkt_len, timestamp)))
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Channel filter
+ */
+
+/* Starts with no channel selected */
+void stp_filter_init(struct stp_filter_t *f)
+{
+	memset(f, 0, sizeof(*f));
+	f->channel = 0xff;
+}
+
+void stp_filter_add(struct stp_filter_t *f, unsigned int first,
+		    unsigned int last)
+{
+	unsigned int c;
+
+	for (c = first; c <= last && c <= 0xff; c++)
+		f->mask[c >> 6] |= 1ULL << (c & 63);
+}
+
+/*
+ * Adds channels from a list such as "10,11,40-47".
+ */
+int stp_filter_parse(struct stp_filter_t *f, const char *list)
+{
+	unsigned long first, last;
+	char *end;
+
+	for (;;) {
+		first = strtoul(list, &end, 0);
+		if (end == list || first > 0xff)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 0);
+			if (end == list || last > 0xff || last < first)
+				return -1;
 		}
+		stp_filter_add(f, first, last);
 
-		i -= (msg_len + 1);
+		if (*end == '\0')
+			return 0;
+		if (*end != ',')
+			return -1;
+		list = end + 1;
 	}
+}
 
-end:
-	return count;
+const char *stp_strerror(int err)
+{
+	switch (err) {
+	case STP_ERR_UNKNOWN_MSG:
+		return "unknown STP message type";
+	case STP_ERR_TRUNCATED:
+		return "message truncated at the beginning of block";
+	case STP_ERR_OVERFLOW_LEFT:
+		return "packet overflowing on left";
+	case STP_ERR_NOMEM:
+		return "out of memory";
+	default:
+		return "unknown error";
+	}
+}
+
+/*
+ * Decodes a single block.
+ */
+int stp_visit_block(char *in, size_t u8size, struct stp_visitor_t *v)
+{
+	struct stp_nibbles nb = { NULL, 0 };
+	uint8_t *nib;
+	int ret = -1;
+
+	nib = stp_nibbles_unpack(&nb, in, u8size);
+	if (nib != NULL)
+		ret = stp_visit_nibbles(nib, 2 * u8size, in, 0, v);
+	else if (v->on_error)
+		v->on_error(v->ctx, STP_ERR_NOMEM, 0);
+
+	stp_nibbles_release(&nb);
+
+	return ret;
 }
 
 /*
@@ -346,129 +709,2087 @@ end:
  * de 56 38 a9 01 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 23 f8
  * de 56 01 00 00 00 00 00 00 00 00 00 00 00 00 00 23 f8
  *
- * Implementation: detects 0x01 followed by 12 to 15 bytes
+ * Implementation: detects 0x01 followed by 12 to 15 bytes, or by at least 8
+ * bytes of 0x00 up to the end of the buffer.
+ * Returns the length of the sync packet starting at off, 0 if there is none.
  */
-static int stp_find_first_sync(char *buf, size_t u8size, off_t start,
-			       off_t *out_off, size_t *out_size)
+static size_t stp_sync_len(const uint8_t *buf, size_t u8size, off_t off)
 {
-	off_t off;
-	size_t size;
+	size_t n;
 
-	off_t i = start;
-	uint32_t a, y, z;
-
-	for (i = start + 4; i <= u8size - 8; i += 4) {
-		if (   *((uint32_t *) &buf[i])     == 0x00000000
-		    && *((uint32_t *) &buf[i + 4]) == 0x00000000) {
-			a = *((uint32_t *) &buf[i - 4]);
-
-			/* First, find beginning position */
-			if ((a >> 24) == 0x01)
-				off = i - 1;
-			else if ((a >> 16) == 0x0001)
-				off = i - 2;
-			else if ((a >> 8) == 0x000001)
-				off = i - 3;
-			else if (a == 0x00000001)
-				off = i - 4;
-			else
-				continue;
+	if (buf[off] != 0x01)
+		return 0;
 
-			/* Then, find the length (between 13 and 16) */
-			y = z = 0;
-			if (i + 8 < u8size)
-			        y = *((uint32_t *) &buf[off + 8]);
-				if (i + 12 < u8size)
-					z = *((uint32_t *) &buf[off + 12]);
-			if (y == 0x00000000) {
-				if (z == 0x00000000)
-					size = 16;
-				else if ((z & 0xffffff) == 0x000000)
-					size = 15;
-				else if ((z & 0xffff) == 0x0000)
-					size = 14;
-				else if ((z & 0xff) == 0x00)
-					size = 13;
-				else
-					continue;
-
-				*out_off = off;
-				*out_size = size;
-				return 0;
-			}
+	for (n = 1; n < STP_SYNC_MAX_LEN && off + n < u8size; n++)
+		if (buf[off + n] != 0x00)
+			break;
+
+	if (n >= 13 || (off + n == u8size && n >= 9))
+		return n;
+
+	return 0;
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON__) || defined(__ARM_NEON)
+#if defined(__SSE2__)
+static inline uint32_t stp_movemask_eq(const uint8_t *p, uint8_t val)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(val)));
+}
+#else
+static inline uint32_t stp_movemask_eq(const uint8_t *p, uint8_t val)
+{
+	static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+					  1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t m = vandq_u8(vceqq_u8(vld1q_u8(p), vdupq_n_u8(val)),
+				vld1q_u8(bits));
+	uint8x8_t r = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+
+	r = vpadd_u8(r, r);
+	r = vpadd_u8(r, r);
+
+	return vget_lane_u16(vreinterpret_u16_u8(r), 0);
+}
+#endif
+
+/*
+ * Looks at 16 positions at a time: a sync packet starts at bit k of the
+ * 0x01 mask if bits k+1 to k+12 of the 0x00 mask are set.
+ */
+static off_t stp_find_sync(const uint8_t *buf, size_t u8size, off_t start,
+			   size_t *out_len)
+{
+	off_t i = start, off;
+	uint32_t ones, zeros, z2, z4, z8, z12;
+
+	for (; i + 32 <= u8size; i += 16) {
+		ones = stp_movemask_eq(&buf[i], 0x01);
+		if (ones == 0)
+			continue;
+
+		zeros = stp_movemask_eq(&buf[i], 0x00)
+			| stp_movemask_eq(&buf[i + 16], 0x00) << 16;
+		zeros >>= 1;
+		z2 = zeros & (zeros >> 1);
+		z4 = z2 & (z2 >> 2);
+		z8 = z4 & (z4 >> 4);
+		z12 = z8 & (z4 >> 8);
+
+		ones &= z12;
+		if (ones != 0) {
+			off = i + __builtin_ctz(ones);
+			*out_len = stp_sync_len(buf, u8size, off);
+			return off;
 		}
 	}
 
+	for (; i < u8size; i++)
+		if ((*out_len = stp_sync_len(buf, u8size, i)) != 0)
+			return i;
+
+	return -1;
+}
+#else
+static off_t stp_find_sync(const uint8_t *buf, size_t u8size, off_t start,
+			   size_t *out_len)
+{
+	const uint8_t *p;
+	off_t i = start;
+
+	while (i < u8size &&
+	       (p = memchr(&buf[i], 0x01, u8size - i)) != NULL) {
+		i = p - buf;
+		if ((*out_len = stp_sync_len(buf, u8size, i)) != 0)
+			return i;
+		i++;
+	}
+
 	return -1;
 }
+#endif
+
+static int stp_blocks_add(struct stp_blocks_t *blocks, off_t off, size_t len)
+{
+	struct stp_block *new_blocks;
+	size_t new_size;
+
+	if (blocks->count == blocks->size) {
+		new_size = blocks->size ? 2 * blocks->size : 64;
+		new_blocks = realloc(blocks->blocks,
+				     new_size * sizeof(struct stp_block));
+		if (new_blocks == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		blocks->blocks = new_blocks;
+		blocks->size = new_size;
+	}
+
+	blocks->blocks[blocks->count].off = off;
+	blocks->blocks[blocks->count].len = len;
+	blocks->count++;
+
+	return 0;
+}
 
 /*
- * Finds the first block, delimited by sync packets.
+ * Splits an ETB buffer into blocks, delimited by sync packets, in one pass.
+ * The table can be passed to stp_read_pkts_in_blocks() and
+ * stp_count_pkts_in_blocks(), and reused for another buffer.
  */
-static int stp_find_first_block(char *buf, size_t u8size, off_t start,
-				off_t *out_off, size_t *out_size)
+int stp_find_blocks(char *buf, size_t u8size, struct stp_blocks_t *blocks)
 {
-	off_t  sync_off, head = start;
+	off_t sync_off, head = 0;
 	size_t sync_len;
 
+	blocks->count = 0;
+	blocks->syncs = 0;
+
 	while (head < u8size) {
-		if (stp_find_first_sync(buf, u8size, head,
-					&sync_off, &sync_len) != 0) {
+		sync_off = stp_find_sync((uint8_t *) buf, u8size, head,
+					 &sync_len);
+		if (sync_off < 0) {
 			// no more sync packet
-			*out_off = head;
-			*out_size = u8size - head;
-			return 0;
+			return stp_blocks_add(blocks, head, u8size - head);
 		} else if (sync_off > head) {
 			// space between two sync packets
-			*out_off = head;
-			*out_size = sync_off - head;
-			return 0;
+			if (stp_blocks_add(blocks, head, sync_off - head))
+				return -1;
 		}
+		blocks->syncs++;
 		head = sync_off + sync_len;
 	}
 
-	return -1;
+	return 0;
 }
 
-struct stp_pkt *stp_read_pkts_in_raw_etb(char *buf, size_t u8size)
+void stp_free_blocks(struct stp_blocks_t *blocks)
 {
-	off_t start = 0;
-	off_t block_off;
-	size_t block_len;
+	free(blocks->blocks);
+	blocks->blocks = NULL;
+	blocks->count = blocks->size = 0;
+}
 
-	struct stp_pkt *pkts, *pkt_list = NULL, *last_pkt;
+/*
+ * Decodes every block of the table, in order, unpacking them into nb, which
+ * the caller releases.
+ */
+static int stp_visit_blocks_nb(char *buf, struct stp_blocks_t *blocks,
+			       struct stp_visitor_t *v, struct stp_nibbles *nb)
+{
+	struct stp_block *block;
+	uint8_t *nib;
+	int ret = 0;
+
+	for (block = blocks->blocks;
+	     block < &blocks->blocks[blocks->count]; block++) {
+		nib = stp_nibbles_unpack(nb, &buf[block->off], block->len);
+		if (nib == NULL) {
+			if (v->on_error)
+				v->on_error(v->ctx, STP_ERR_NOMEM, block->off);
+			ret = -1;
+			break;
+		}
 
-	while (stp_find_first_block(buf, u8size, start, &block_off, &block_len) == 0) {
-		/*fprintf(stderr, "found block %x -> %x\n",
-			(int) block_off, (int) block_off + block_len);//*/
-		pkts = stp_read_pkts(&buf[block_off], block_len);
+		ret = stp_visit_nibbles(nib, 2 * block->len, &buf[block->off],
+					block->off, v);
+		if (ret)
+			break;
+	}
 
-		if (pkt_list == NULL)
-			pkt_list = pkts;
-		else
-			last_pkt->next = pkts;
+	return ret;
+}
 
-		for (last_pkt = pkts; last_pkt->next != NULL; last_pkt = last_pkt->next) ;
+/*
+ * Decodes every block of the table, in order.
+ */
+int stp_visit_blocks(char *buf, struct stp_blocks_t *blocks,
+		     struct stp_visitor_t *v)
+{
+	struct stp_nibbles nb = { NULL, 0 };
+	int ret;
 
-		start = block_off + block_len;
-	}
+	ret = stp_visit_blocks_nb(buf, blocks, v, &nb);
+	stp_nibbles_release(&nb);
 
-	return pkt_list;
+	return ret;
 }
 
-size_t stp_count_pkts_in_raw_etb(char *buf, size_t u8size)
+/*
+ * Splits an ETB buffer into blocks and decodes them.
+ */
+int stp_visit_raw_etb(char *buf, size_t u8size, struct stp_visitor_t *v)
 {
-	off_t start = 0;
-	off_t block_off;
-	size_t block_len;
+	struct stp_blocks_t blocks = { NULL, 0, 0, 0 };
+	int ret = -1;
 
-	size_t count = 0;
+	if (stp_find_blocks(buf, u8size, &blocks) == 0)
+		ret = stp_visit_blocks(buf, &blocks, v);
+	else if (v->on_error)
+		v->on_error(v->ctx, STP_ERR_NOMEM, 0);
 
-	while (stp_find_first_block(buf, u8size, start, &block_off, &block_len) == 0) {
-		count += stp_count_pkts(&buf[block_off], block_len);
+	stp_free_blocks(&blocks);
 
-		start = block_off + block_len;
-	}
+	return ret;
+}
 
-	return count;
+static int stp_print_error(void *ctx, int err, off_t offset)
+{
+	fprintf(stderr, "ERROR: %s (offset 0x%lx)\n", stp_strerror(err),
+		(long) offset);
+
+	return 0;
+}
+
+/*
+ * Linked lists of packets
+ */
+struct stp_list_ctx {
+	struct stp_pkt *head, *tail;
+	struct stp_arena_t *arena;
+	unsigned char channel;	/* set by a channel message, for the next
+				   packet */
+	unsigned char master;	/* set by the last master message */
+};
+
+static int stp_list_on_packet(void *ctx, const char *data, size_t len,
+			      int timestamp)
+{
+	struct stp_list_ctx *c = ctx;
+	struct stp_pkt *pkt;
+
+	pkt = new_stp_pkt(len, timestamp, c->arena);
+	if (pkt == NULL)
+		return -1;
+
+	memcpy(pkt->data, data, len);
+	pkt->channel = c->channel;
+	pkt->master = c->master;
+	c->channel = 0xff;
+
+	if (c->head == NULL)
+		c->head = pkt;
+	else
+		c->tail->next = pkt;
+	c->tail = pkt;
+
+	return 0;
+}
+
+static int stp_list_on_channel(void *ctx, unsigned char channel)
+{
+	((struct stp_list_ctx *) ctx)->channel = channel;
+
+	return 0;
+}
+
+static int stp_list_on_master(void *ctx, unsigned char master)
+{
+	((struct stp_list_ctx *) ctx)->master = master;
+
+	return 0;
+}
+
+#define STP_LIST_VISITOR(c) { \
+	.ctx = (c), \
+	.on_packet = stp_list_on_packet, \
+	.on_channel = stp_list_on_channel, \
+	.on_master = stp_list_on_master, \
+	.on_error = stp_print_error, \
+}
+
+/*
+ * Takes an ETB block and find packets inside.
+ * Returns a linked-list of struct stp_pkt.
+ */
+struct stp_pkt *stp_read_pkts(char *in, size_t u8size)
+{
+	struct stp_list_ctx c = { NULL, NULL, NULL, 0xff, 0xff };
+	struct stp_visitor_t v = STP_LIST_VISITOR(&c);
+
+	stp_visit_block(in, u8size, &v);
+
+	return c.head;
+}
+
+/*
+ * Packets are allocated from the arena if not NULL, otherwise the list must
+ * be freed with free_stp_pkt_list().
+ */
+struct stp_pkt *stp_read_pkts_in_blocks(char *buf, struct stp_blocks_t *blocks,
+					struct stp_arena_t *arena)
+{
+	struct stp_list_ctx c = { NULL, NULL, arena, 0xff, 0xff };
+	struct stp_visitor_t v = STP_LIST_VISITOR(&c);
+
+	stp_visit_blocks(buf, blocks, &v);
+
+	return c.head;
+}
+
+/*
+ * The master is carried in *master from one call to the next.
+ */
+static struct stp_pkt *stp_read_pkts_filtered(char *buf, size_t u8size,
+					      struct stp_arena_t *arena,
+					      struct stp_filter_t *filter,
+					      unsigned char *master)
+{
+	struct stp_list_ctx c = { NULL, NULL, arena, 0xff, *master };
+	struct stp_visitor_t v = STP_LIST_VISITOR(&c);
+
+	v.filter = filter;
+	stp_visit_raw_etb(buf, u8size, &v);
+	*master = c.master;
+
+	return c.head;
+}
+
+struct stp_pkt *stp_read_pkts_in_raw_etb_arena(char *buf, size_t u8size,
+					       struct stp_arena_t *arena)
+{
+	unsigned char master = 0xff;
+
+	return stp_read_pkts_filtered(buf, u8size, arena, NULL, &master);
+}
+
+struct stp_pkt *stp_read_pkts_in_raw_etb(char *buf, size_t u8size)
+{
+	return stp_read_pkts_in_raw_etb_arena(buf, u8size, NULL);
+}
+
+/*
+ * Packet counts
+ */
+static int stp_count_on_packet(void *ctx, const char *data, size_t len,
+			       int timestamp)
+{
+	(*(size_t *) ctx)++;
+
+	return 0;
+}
+
+#define STP_COUNT_VISITOR(count) { \
+	.ctx = (count), \
+	.flags = STP_VISIT_NO_PAYLOAD | STP_VISIT_UNORDERED, \
+	.on_packet = stp_count_on_packet, \
+	.on_error = stp_print_error, \
+}
+
+size_t stp_count_pkts(char *in, size_t u8size)
+{
+	size_t count = 0;
+	struct stp_visitor_t v = STP_COUNT_VISITOR(&count);
+
+	stp_visit_block(in, u8size, &v);
+
+	return count;
+}
+
+size_t stp_count_pkts_in_blocks(char *buf, struct stp_blocks_t *blocks)
+{
+	size_t count = 0;
+	struct stp_visitor_t v = STP_COUNT_VISITOR(&count);
+
+	stp_visit_blocks(buf, blocks, &v);
+
+	return count;
+}
+
+size_t stp_count_pkts_in_raw_etb(char *buf, size_t u8size)
+{
+	size_t count = 0;
+	struct stp_visitor_t v = STP_COUNT_VISITOR(&count);
+
+	stp_visit_raw_etb(buf, u8size, &v);
+
+	return count;
+}
+
+/*
+ * Packet arrays
+ *
+ * Packets are stored as descriptors in a contiguous array and payloads in one
+ * packed heap.  A packet made of a single byte-aligned message is not copied:
+ * its descriptor points to the input buffer.
+ */
+
+static int stp_pkt_array_reserve(struct stp_pkt_array_t *arr,
+				 size_t pkts, size_t heap)
+{
+	struct stp_pkt_desc *new_pkts;
+	char *new_heap;
+	size_t new_size;
+
+	if (arr->count + pkts > arr->size) {
+		new_size = arr->size ? arr->size : 1024;
+		while (new_size < arr->count + pkts)
+			new_size *= 2;
+		new_pkts = realloc(arr->pkts,
+				   new_size * sizeof(struct stp_pkt_desc));
+		if (new_pkts == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		arr->pkts = new_pkts;
+		arr->size = new_size;
+	}
+
+	if (arr->heap_len + heap > arr->heap_size) {
+		new_size = arr->heap_size ? arr->heap_size : 16384;
+		while (new_size < arr->heap_len + heap)
+			new_size *= 2;
+		new_heap = realloc(arr->heap, new_size);
+		if (new_heap == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		arr->heap = new_heap;
+		arr->heap_size = new_size;
+	}
+
+	return 0;
+}
+
+static int stp_array_on_packet(void *ctx, const char *data, size_t len,
+			       int timestamp)
+{
+	struct stp_pkt_array_t *arr = ctx;
+	struct stp_pkt_desc *pkt;
+
+	if (stp_pkt_array_reserve(arr, 1, len))
+		return -1;
+
+	pkt = &arr->pkts[arr->count++];
+	arr->cycles += timestamp;
+	pkt->cycles = arr->cycles;
+	pkt->len = len;
+	pkt->timestamp = timestamp;
+	pkt->channel = arr->channel;
+	pkt->master = arr->master;
+
+	if (data >= arr->in && data + len <= arr->in + arr->in_len) {
+		pkt->flags = STP_PKT_IN_INPUT;
+		pkt->offset = data - arr->in;
+	} else {
+		pkt->flags = 0;
+		pkt->offset = arr->heap_len;
+		/* heap is still NULL when only empty payloads were seen */
+		if (len > 0)
+			memcpy(&arr->heap[arr->heap_len], data, len);
+		arr->heap_len += len;
+	}
+
+	return 0;
+}
+
+static int stp_array_on_channel(void *ctx, unsigned char channel)
+{
+	((struct stp_pkt_array_t *) ctx)->channel = channel;
+
+	return 0;
+}
+
+static int stp_array_on_master(void *ctx, unsigned char master)
+{
+	((struct stp_pkt_array_t *) ctx)->master = master;
+
+	return 0;
+}
+
+int stp_pkt_array_init(struct stp_pkt_array_t *arr)
+{
+	memset(arr, 0, sizeof(*arr));
+	arr->channel = 0xff;
+	arr->master = 0xff;
+
+	return 0;
+}
+
+void stp_pkt_array_free(struct stp_pkt_array_t *arr)
+{
+	free(arr->pkts);
+	free(arr->heap);
+	stp_pkt_array_init(arr);
+}
+
+/*
+ * Decodes an ETB buffer into the array, replacing its previous packets.
+ * Payloads may point into the buffer, which must be kept as long as the
+ * array is used.  Time and channel continue from the previous buffer.
+ */
+int stp_read_pkt_array(char *buf, size_t u8size, struct stp_pkt_array_t *arr)
+{
+	struct stp_visitor_t v = {
+		.ctx = arr,
+		.on_packet = stp_array_on_packet,
+		.on_channel = stp_array_on_channel,
+		.on_master = stp_array_on_master,
+		.on_error = stp_print_error,
+	};
+
+	arr->count = 0;
+	arr->heap_len = 0;
+	arr->in = buf;
+	arr->in_len = u8size;
+
+	return stp_visit_raw_etb(buf, u8size, &v) < 0 ? -1 : 0;
+}
+
+/*
+ * Returns the index of the first packet at or after the given cycle count
+ * (arr->count if none).
+ */
+size_t stp_pkt_array_find(struct stp_pkt_array_t *arr, uint64_t cycles)
+{
+	size_t lo = 0, hi = arr->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (arr->pkts[mid].cycles < cycles)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Fills iov with the payloads of n packets starting at index first, ready
+ * for writev().  Returns the number of entries filled.
+ */
+int stp_pkt_array_iovec(struct stp_pkt_array_t *arr, size_t first, size_t n,
+			struct iovec *iov)
+{
+	size_t k;
+
+	if (first > arr->count)
+		return 0;
+	if (n > arr->count - first)
+		n = arr->count - first;
+
+	for (k = 0; k < n; k++) {
+		iov[k].iov_base = (void *) stp_pkt_array_data(arr, first + k);
+		iov[k].iov_len = arr->pkts[first + k].len;
+	}
+
+	return n;
+}
+
+/*
+ * Parallel decoding
+ *
+ * Blocks are independent, except for the time and the channel that carry
+ * over from one block to the next.  Workers decode each block as if it was
+ * the first one, into their own packet array, and record what the block
+ * needs from the previous ones.  The results are then merged in order: the
+ * cycle counts are offset by the time elapsed before the block, and packets
+ * that come before the first channel message of their block get the channel
+ * left by the previous blocks.
+ */
+
+struct stp_pool_block {
+	struct stp_pkt_array_t *arr;	/* array of the worker that decoded it */
+	size_t first, count;		/* its packets in that array */
+	uint64_t cycles;		/* elapsed during the block */
+	size_t lead;			/* packets before the first channel
+					   message, -1 if there is none */
+	size_t master_lead;		/* same for master messages */
+	unsigned char channel;		/* channel at the end of the block */
+	unsigned char master;
+	int err;
+	off_t err_off;
+};
+
+struct stp_pool_worker {
+	struct stp_pool_t *pool;
+	pthread_mutex_t lock;
+	size_t next, end;		/* blocks left to decode */
+	struct stp_pkt_array_t arr;
+	struct stp_nibbles nb;
+	struct stp_pool_block *block;	/* block being decoded */
+};
+
+static int stp_pool_on_packet(void *ctx, const char *data, size_t len,
+			      int timestamp)
+{
+	struct stp_pool_worker *w = ctx;
+
+	return stp_array_on_packet(&w->arr, data, len, timestamp);
+}
+
+static int stp_pool_on_channel(void *ctx, unsigned char channel)
+{
+	struct stp_pool_worker *w = ctx;
+
+	if (w->block->lead == (size_t) -1)
+		w->block->lead = w->arr.count - w->block->first;
+	w->arr.channel = channel;
+
+	return 0;
+}
+
+static int stp_pool_on_master(void *ctx, unsigned char master)
+{
+	struct stp_pool_worker *w = ctx;
+
+	if (w->block->master_lead == (size_t) -1)
+		w->block->master_lead = w->arr.count - w->block->first;
+	w->arr.master = master;
+
+	return 0;
+}
+
+static int stp_pool_on_error(void *ctx, int err, off_t offset)
+{
+	struct stp_pool_worker *w = ctx;
+
+	/* Reported in order when merging */
+	w->block->err = err;
+	w->block->err_off = offset;
+
+	return 0;
+}
+
+static void stp_pool_decode(struct stp_pool_worker *w, size_t n)
+{
+	struct stp_pool_t *pool = w->pool;
+	struct stp_block *block = &pool->blocks->blocks[n];
+	struct stp_pool_block *res = &pool->results[n];
+	struct stp_visitor_t v = {
+		.ctx = w,
+		.on_packet = stp_pool_on_packet,
+		.on_channel = stp_pool_on_channel,
+		.on_master = stp_pool_on_master,
+		.on_error = stp_pool_on_error,
+	};
+	uint8_t *nib;
+
+	res->arr = &w->arr;
+	res->first = w->arr.count;
+	res->lead = -1;
+	res->master_lead = -1;
+	res->err = 0;
+	w->block = res;
+	w->arr.cycles = 0;
+
+	nib = stp_nibbles_unpack(&w->nb, &pool->buf[block->off], block->len);
+	if (nib == NULL)
+		stp_pool_on_error(w, STP_ERR_NOMEM, block->off);
+	else if (stp_visit_nibbles(nib, 2 * block->len,
+				   &pool->buf[block->off], block->off, &v))
+		stp_pool_on_error(w, STP_ERR_NOMEM, block->off);
+
+	res->count = w->arr.count - res->first;
+	res->cycles = w->arr.cycles;
+	res->channel = w->arr.channel;
+	res->master = w->arr.master;
+}
+
+/*
+ * Takes the next block of the worker, or steals the second half of the
+ * blocks left to another worker.  Returns -1 when there is nothing left.
+ */
+static ssize_t stp_pool_next(struct stp_pool_worker *w)
+{
+	struct stp_pool_t *pool = w->pool;
+	struct stp_pool_worker *victim;
+	size_t n, mid, end;
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->next < w->end) {
+		n = w->next++;
+		pthread_mutex_unlock(&w->lock);
+		return n;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 1; i < pool->nthreads; i++) {
+		victim = &pool->workers[(w - pool->workers + i) % pool->nthreads];
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->next >= victim->end) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		end = victim->end;
+		mid = victim->next + (end - victim->next) / 2;
+		victim->end = mid;
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&w->lock);
+		w->next = mid + 1;
+		w->end = end;
+		pthread_mutex_unlock(&w->lock);
+		return mid;
+	}
+
+	return -1;
+}
+
+static void *stp_pool_thread(void *arg)
+{
+	struct stp_pool_worker *w = arg;
+	struct stp_pool_t *pool = w->pool;
+	unsigned long job = 0;
+	ssize_t n;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->job == job && !pool->quit)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		while ((n = stp_pool_next(w)) >= 0)
+			stp_pool_decode(w, n);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+int stp_pool_init(struct stp_pool_t *pool, int nthreads)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	if (nthreads < 1)
+		nthreads = 1;
+
+	pool->threads = calloc(nthreads, sizeof(pthread_t));
+	pool->workers = calloc(nthreads, sizeof(struct stp_pool_worker));
+	if (pool->threads == NULL || pool->workers == NULL) {
+		perror("calloc");
+		goto err_free;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		pool->workers[i].pool = pool;
+		pthread_mutex_init(&pool->workers[i].lock, NULL);
+		stp_pkt_array_init(&pool->workers[i].arr);
+		if (pthread_create(&pool->threads[i], NULL, stp_pool_thread,
+				   &pool->workers[i])) {
+			fprintf(stderr, "error: couldn't create thread\n");
+			pool->nthreads = i;
+			stp_pool_destroy(pool);
+			return -1;
+		}
+		pool->nthreads = i + 1;
+	}
+
+	return 0;
+
+err_free:
+	free(pool->threads);
+	free(pool->workers);
+	return -1;
+}
+
+void stp_pool_destroy(struct stp_pool_t *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+		pthread_mutex_destroy(&pool->workers[i].lock);
+		stp_pkt_array_free(&pool->workers[i].arr);
+		stp_nibbles_release(&pool->workers[i].nb);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool->workers);
+	free(pool->results);
+}
+
+/*
+ * Copies the packets of the blocks, in order, into arr.
+ */
+static int stp_pool_merge(struct stp_pool_t *pool, struct stp_pkt_array_t *arr)
+{
+	struct stp_pool_block *res;
+	struct stp_pkt_desc *pkt;
+	size_t n, k;
+	int ret = 0;
+
+	for (n = 0; n < pool->blocks->count; n++) {
+		res = &pool->results[n];
+
+		if (res->err == STP_ERR_NOMEM)
+			ret = -1;
+		if (res->err)
+			stp_print_error(NULL, res->err, res->err_off);
+
+		if (stp_pkt_array_reserve(arr, res->count, 0))
+			return -1;
+
+		for (k = 0; k < res->count; k++) {
+			pkt = &arr->pkts[arr->count++];
+			*pkt = res->arr->pkts[res->first + k];
+			pkt->cycles += arr->cycles;
+			if (k < res->lead)
+				pkt->channel = arr->channel;
+			if (k < res->master_lead)
+				pkt->master = arr->master;
+			if (pkt->flags & STP_PKT_IN_INPUT)
+				continue;
+
+			/* Either heap may still be NULL for an empty payload */
+			if (pkt->len > 0) {
+				if (stp_pkt_array_reserve(arr, 0, pkt->len))
+					return -1;
+				memcpy(&arr->heap[arr->heap_len],
+				       &res->arr->heap[pkt->offset], pkt->len);
+			}
+			pkt->offset = arr->heap_len;
+			arr->heap_len += pkt->len;
+		}
+
+		arr->cycles += res->cycles;
+		if (res->lead != (size_t) -1)
+			arr->channel = res->channel;
+		if (res->master_lead != (size_t) -1)
+			arr->master = res->master;
+	}
+
+	return ret;
+}
+
+/*
+ * Same as stp_read_pkt_array(), for a buffer already split into blocks, using
+ * the threads of the pool.
+ */
+int stp_pool_read_pkt_array(struct stp_pool_t *pool, char *buf,
+			    struct stp_blocks_t *blocks,
+			    struct stp_pkt_array_t *arr)
+{
+	struct stp_pool_block *results;
+	struct stp_pool_worker *w;
+	size_t count = blocks->count, end = 0;
+	int i;
+
+	if (count > pool->results_size) {
+		results = realloc(pool->results,
+				  count * sizeof(struct stp_pool_block));
+		if (results == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		pool->results = results;
+		pool->results_size = count;
+	}
+
+	if (count > 0)
+		end = blocks->blocks[count - 1].off + blocks->blocks[count - 1].len;
+
+	for (i = 0; i < pool->nthreads; i++) {
+		w = &pool->workers[i];
+		w->next = count * i / pool->nthreads;
+		w->end = count * (i + 1) / pool->nthreads;
+		w->arr.count = 0;
+		w->arr.heap_len = 0;
+		w->arr.in = buf;
+		w->arr.in_len = end;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->buf = buf;
+	pool->blocks = blocks;
+	pool->running = pool->nthreads;
+	pool->job++;
+	pthread_cond_broadcast(&pool->start);
+	while (pool->running > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	arr->count = 0;
+	arr->heap_len = 0;
+	arr->in = buf;
+	arr->in_len = end;
+
+	return stp_pool_merge(pool, arr);
+}
+
+/*
+ * Clock calibration
+ */
+
+void stp_calib_init(struct stp_calib_t *cal)
+{
+	memset(cal, 0, sizeof(*cal));
+}
+
+void stp_calib_free(struct stp_calib_t *cal)
+{
+	free(cal->anchors);
+	stp_calib_init(cal);
+}
+
+/*
+ * Adds a time sync packet, and updates the fit in O(1) (Welford's method, on
+ * cycles and ns relative to the first anchor for precision).
+ */
+int stp_calib_add(struct stp_calib_t *cal, uint64_t cycles, int64_t ns)
+{
+	struct stp_anchor *new_anchors;
+	size_t new_size;
+	double x, y, dx, dy;
+
+	if (cal->count == cal->size) {
+		new_size = cal->size ? 2 * cal->size : 64;
+		new_anchors = realloc(cal->anchors,
+				      new_size * sizeof(struct stp_anchor));
+		if (new_anchors == NULL) {
+			perror("realloc");
+			return -1;
+		}
+		cal->anchors = new_anchors;
+		cal->size = new_size;
+	}
+
+	cal->anchors[cal->count].cycles = cycles;
+	cal->anchors[cal->count].ns = ns;
+	cal->count++;
+
+	x = (double) (cycles - cal->anchors[0].cycles);
+	y = (double) (ns - cal->anchors[0].ns);
+	dx = x - cal->mean_x;
+	dy = y - cal->mean_y;
+	cal->mean_x += dx / cal->count;
+	cal->mean_y += dy / cal->count;
+	cal->cxx += dx * (x - cal->mean_x);
+	cal->cxy += dx * (y - cal->mean_y);
+	cal->cyy += dy * (y - cal->mean_y);
+
+	return 0;
+}
+
+/* Fitted frequency, 0 if there are not enough anchors yet */
+static double stp_calib_freq(struct stp_calib_t *cal)
+{
+	if (cal->count < 2 || cal->cxx <= 0 || cal->cxy <= 0)
+		return 0;
+	return STP_NSEC_PER_SEC * cal->cxx / cal->cxy;
+}
+
+/*
+ * Computes the frequency and the residual error of the anchors around the
+ * fitted line.  Returns -1 if there are not enough anchors.
+ */
+int stp_calib_fit(struct stp_calib_t *cal)
+{
+	double slope, r;
+	size_t k;
+
+	cal->freq = stp_calib_freq(cal);
+	if (cal->freq == 0)
+		return -1;
+
+	slope = cal->cxy / cal->cxx;
+	cal->rms_ns = sqrt(fmax(cal->cyy - slope * cal->cxy, 0) / cal->count);
+	cal->max_ns = 0;
+	for (k = 0; k < cal->count; k++) {
+		r = (double) (cal->anchors[k].ns - cal->anchors[0].ns) -
+		    cal->mean_y - slope *
+		    ((double) (cal->anchors[k].cycles -
+			       cal->anchors[0].cycles) - cal->mean_x);
+		if (fabs(r) > cal->max_ns)
+			cal->max_ns = fabs(r);
+	}
+
+	return 0;
+}
+
+struct stp_calib_ctx {
+	struct stp_calib_t *cal;
+	uint64_t cycles;
+};
+
+static int stp_calib_on_packet(void *ctx, const char *data, size_t len,
+			       int timestamp)
+{
+	struct stp_calib_ctx *c = ctx;
+	uint32_t sec, usec;
+
+	c->cycles += timestamp;
+	if (!stp_is_time_sync(data, len))
+		return 0;
+
+	memcpy(&sec, &data[4], 4);
+	memcpy(&usec, &data[8], 4);
+	return stp_calib_add(c->cal, c->cycles,
+			     sec * STP_NSEC_PER_SEC + usec * 1000ULL);
+}
+
+/*
+ * Collects the time sync packets of a trace.  An empty channel filter keeps
+ * the payloads of other packets from being assembled.
+ */
+int stp_calib_scan(char *buf, size_t u8size, struct stp_calib_t *cal)
+{
+	struct stp_calib_ctx c = { cal, 0 };
+	struct stp_filter_t filter;
+	struct stp_visitor_t v = {
+		.ctx = &c,
+		.on_packet = stp_calib_on_packet,
+		.filter = &filter,
+	};
+
+	stp_filter_init(&filter);
+
+	return stp_visit_raw_etb(buf, u8size, &v) < 0 ? -1 : 0;
+}
+
+/*
+ * Timeline
+ */
+
+/* Sets the length of a cycle to ns / cycles */
+static void stp_timeline_set_rate(struct stp_timeline_t *tl, uint64_t ns,
+				  uint64_t cycles)
+{
+	while (cycles >> 32) {
+		ns >>= 1;
+		cycles >>= 1;
+	}
+	tl->mult = ns / cycles;
+	tl->num = ns % cycles;
+	tl->den = cycles;
+}
+
+void stp_timeline_init(struct stp_timeline_t *tl, uint32_t freq)
+{
+	memset(tl, 0, sizeof(*tl));
+	tl->freq = freq;
+	stp_timeline_set_rate(tl, STP_NSEC_PER_SEC, freq);
+}
+
+/*
+ * Floor of cycles * (mult + num / den), and its remainder.  cycles is split
+ * so that nothing overflows 64 bits.
+ */
+static int64_t stp_cycles_to_ns(struct stp_timeline_t *tl, uint64_t cycles,
+				 uint64_t *rem)
+{
+	uint64_t r = (cycles % tl->den) * tl->num;
+
+	if (rem != NULL)
+		*rem = r % tl->den;
+	return cycles * tl->mult + (cycles / tl->den) * tl->num +
+	       r / tl->den;
+}
+
+/* Last anchor at or before cycles, or -1 */
+static ssize_t stp_calib_find(struct stp_calib_t *cal, uint64_t cycles)
+{
+	size_t lo = 0, hi = cal->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cal->anchors[mid].cycles <= cycles)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (ssize_t) lo - 1;
+}
+
+/*
+ * Sets the rate of the timeline after its last time sync packet, at
+ * sync_cycles: the slope to the next anchor, else the fitted frequency,
+ * else the nominal one.
+ */
+static void stp_timeline_rate(struct stp_timeline_t *tl)
+{
+	struct stp_calib_t *cal = tl->calib;
+	struct stp_anchor *a;
+	double freq;
+	ssize_t k;
+
+	if (cal != NULL) {
+		k = stp_calib_find(cal, tl->sync_cycles);
+		a = k >= 0 && (size_t) k + 1 < cal->count ?
+		    &cal->anchors[k] : NULL;
+		if (a != NULL && a[1].cycles > a[0].cycles &&
+		    a[1].ns > a[0].ns) {
+			stp_timeline_set_rate(tl, a[1].ns - a[0].ns,
+					      a[1].cycles - a[0].cycles);
+			return;
+		}
+
+		freq = stp_calib_freq(cal);
+		if (freq >= 1 && freq < 4294967295.0) {
+			stp_timeline_set_rate(tl, STP_NSEC_PER_SEC,
+					      (uint64_t) (freq + 0.5));
+			return;
+		}
+	}
+
+	stp_timeline_set_rate(tl, STP_NSEC_PER_SEC, tl->freq);
+}
+
+/*
+ * Uses the anchors of a calibration, from stp_calib_scan() for instance.
+ * The time sync packets met past its last anchor are added to it.
+ */
+void stp_timeline_calibrate(struct stp_timeline_t *tl,
+			    struct stp_calib_t *cal)
+{
+	tl->calib = cal;
+	stp_timeline_seek(tl, tl->cycles, tl->sync_cycles, tl->sync_ns);
+}
+
+/*
+ * Puts the timeline at the given cycles, the last time sync packet having
+ * been at sync_cycles and sync_ns, e.g. from an index entry.
+ */
+void stp_timeline_seek(struct stp_timeline_t *tl, uint64_t cycles,
+		       uint64_t sync_cycles, int64_t sync_ns)
+{
+	ssize_t k;
+
+	if (tl->calib != NULL &&
+	    (k = stp_calib_find(tl->calib, cycles)) >= 0) {
+		sync_cycles = tl->calib->anchors[k].cycles;
+		sync_ns = tl->calib->anchors[k].ns;
+	}
+
+	tl->cycles = cycles;
+	tl->sync_cycles = sync_cycles;
+	tl->sync_ns = sync_ns;
+	stp_timeline_rate(tl);
+	tl->ns = sync_ns + stp_cycles_to_ns(tl, cycles - sync_cycles,
+					    &tl->rem);
+}
+
+/* data is a time sync packet, at the current cycles */
+void stp_timeline_anchor(struct stp_timeline_t *tl, const char *data)
+{
+	struct stp_calib_t *cal = tl->calib;
+	uint32_t sec, usec;
+
+	memcpy(&sec, &data[4], 4);
+	memcpy(&usec, &data[8], 4);
+
+	tl->sync_cycles = tl->cycles;
+	tl->sync_ns = sec * STP_NSEC_PER_SEC + usec * 1000ULL;
+	tl->drift_ns = tl->sync_ns - tl->ns;
+	tl->ns = tl->sync_ns;
+	tl->rem = 0;
+	tl->syncs++;
+
+	if (cal != NULL) {
+		if (cal->count == 0 ||
+		    tl->cycles > cal->anchors[cal->count - 1].cycles)
+			stp_calib_add(cal, tl->cycles, tl->sync_ns);
+		stp_timeline_rate(tl);
+	}
+}
+
+/* Time at the given cycles, from the last time sync packet */
+int64_t stp_timeline_cycles_ns(struct stp_timeline_t *tl, uint64_t cycles)
+{
+	if (cycles >= tl->sync_cycles)
+		return tl->sync_ns + stp_cycles_to_ns(tl,
+					cycles - tl->sync_cycles, NULL);
+	return tl->sync_ns - stp_cycles_to_ns(tl,
+					tl->sync_cycles - cycles, NULL);
+}
+
+/*
+ * Index
+ */
+
+struct stp_index_ctx {
+	struct stp_index_entry state;	/* carried from block to block */
+};
+
+static int stp_index_on_packet(void *ctx, const char *data, size_t len,
+			       int timestamp)
+{
+	struct stp_index_entry *st = &((struct stp_index_ctx *) ctx)->state;
+
+	st->cycles += timestamp;
+	st->pkts++;
+
+	if (stp_is_time_sync(data, len)) {
+		memcpy(&st->sync_sec, &data[4], 4);
+		memcpy(&st->sync_usec, &data[8], 4);
+		st->sync_cycles = st->cycles;
+		st->has_sync = 1;
+	}
+
+	return 0;
+}
+
+static int stp_index_on_master(void *ctx, unsigned char master)
+{
+	((struct stp_index_ctx *) ctx)->state.master = master;
+
+	return 0;
+}
+
+static int stp_index_on_channel(void *ctx, unsigned char channel)
+{
+	/* 0xff means no channel, as in packet lists */
+	if (channel != 0xff)
+		((struct stp_index_ctx *) ctx)->state.channel = channel;
+
+	return 0;
+}
+
+/*
+ * Decodes a whole buffer and records the state at the beginning of each of
+ * its blocks.
+ */
+int stp_index_build(char *buf, size_t u8size, struct stp_index_t *idx)
+{
+	struct stp_blocks_t blocks = { NULL, 0, 0, 0 };
+	struct stp_blocks_t one;
+	struct stp_nibbles nb = { NULL, 0 };
+	struct stp_index_ctx c;
+	struct stp_visitor_t v = {
+		.ctx = &c,
+		.on_packet = stp_index_on_packet,
+		.on_channel = stp_index_on_channel,
+		.on_master = stp_index_on_master,
+		.on_error = stp_print_error,
+	};
+	struct stp_index_entry *entry;
+	size_t n;
+	int ret = -1;
+
+	memset(idx, 0, sizeof(*idx));
+	memset(&c, 0, sizeof(c));
+	c.state.channel = 0xff;
+	c.state.master = 0xff;
+
+	if (stp_find_blocks(buf, u8size, &blocks))
+		goto out;
+
+	idx->entries = calloc(blocks.count ? blocks.count : 1,
+			      sizeof(struct stp_index_entry));
+	if (idx->entries == NULL) {
+		perror("calloc");
+		goto out;
+	}
+	idx->size = blocks.count;
+
+	for (n = 0; n < blocks.count; n++) {
+		entry = &idx->entries[n];
+		*entry = c.state;
+		entry->off = blocks.blocks[n].off;
+		entry->len = blocks.blocks[n].len;
+
+		/* Blocks are visited one at a time, unpacked in the same
+		 * buffer */
+		one.blocks = &blocks.blocks[n];
+		one.count = 1;
+		if (stp_visit_blocks_nb(buf, &one, &v, &nb) < 0)
+			goto out;
+
+		entry->count = c.state.pkts - entry->pkts;
+	}
+
+	memcpy(idx->hdr.magic, STP_INDEX_MAGIC, 4);
+	idx->hdr.version = STP_INDEX_VERSION;
+	idx->hdr.trace_size = u8size;
+	idx->hdr.count = blocks.count;
+	idx->hdr.pkts = c.state.pkts;
+	idx->hdr.cycles = c.state.cycles;
+	ret = 0;
+
+out:
+	stp_nibbles_release(&nb);
+	stp_free_blocks(&blocks);
+	return ret;
+}
+
+static int stp_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int stp_index_save(struct stp_index_t *idx, const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("open");
+		return -1;
+	}
+
+	if (stp_write_all(fd, &idx->hdr, sizeof(idx->hdr)) ||
+	    stp_write_all(fd, idx->entries,
+			  idx->hdr.count * sizeof(struct stp_index_entry))) {
+		perror("write");
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
+/*
+ * Maps an index file.  Nothing is read but the header, so that opening the
+ * index of a large trace is immediate.
+ */
+int stp_index_load(struct stp_index_t *idx, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(idx, 0, sizeof(*idx));
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 ||
+	    (size_t) st.st_size < sizeof(struct stp_index_header))
+		goto err_close;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto err_close;
+	close(fd);
+
+	memcpy(&idx->hdr, map, sizeof(idx->hdr));
+	if (memcmp(idx->hdr.magic, STP_INDEX_MAGIC, 4) ||
+	    idx->hdr.version != STP_INDEX_VERSION ||
+	    idx->hdr.count > (st.st_size - sizeof(struct stp_index_header))
+			     / sizeof(struct stp_index_entry)) {
+		fprintf(stderr, "error: %s is not a valid index\n", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	idx->map = map;
+	idx->map_len = st.st_size;
+	idx->entries = (struct stp_index_entry *)
+		((char *) map + sizeof(struct stp_index_header));
+	idx->size = idx->hdr.count;
+
+	return 0;
+
+err_close:
+	close(fd);
+	return -1;
+}
+
+void stp_index_free(struct stp_index_t *idx)
+{
+	if (idx->map != NULL)
+		munmap(idx->map, idx->map_len);
+	else
+		free(idx->entries);
+	memset(idx, 0, sizeof(*idx));
+}
+
+/*
+ * Returns the index of the block that contains the given packet (the last
+ * one if it is past the end).
+ */
+size_t stp_index_find_pkt(struct stp_index_t *idx, uint64_t pkt)
+{
+	size_t lo = 0, hi = idx->hdr.count, mid;
+
+	/* last entry starting at or before pkt */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].pkts <= pkt)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Returns the index of the block where packets at or after the given cycle
+ * count start.
+ */
+size_t stp_index_find_cycles(struct stp_index_t *idx, uint64_t cycles)
+{
+	size_t lo = 0, hi = idx->hdr.count, mid;
+
+	/* last block starting before cycles */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].cycles < cycles)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Statistics
+ */
+
+static size_t stp_hist_bucket(uint64_t value)
+{
+	int e;
+
+	if (value < (1 << STP_HIST_SUB_BITS))
+		return value;
+	if (value >> STP_HIST_MAX_BITS)
+		return STP_HIST_BUCKETS - 1;
+
+	e = 63 - __builtin_clzll(value);
+	return ((e - STP_HIST_SUB_BITS + 1) << STP_HIST_SUB_BITS) +
+	       ((value >> (e - STP_HIST_SUB_BITS)) &
+		((1 << STP_HIST_SUB_BITS) - 1));
+}
+
+/* Lowest value of a bucket */
+static uint64_t stp_hist_value(size_t bucket)
+{
+	size_t e = bucket >> STP_HIST_SUB_BITS;
+	uint64_t sub = bucket & ((1 << STP_HIST_SUB_BITS) - 1);
+
+	if (e == 0)
+		return sub;
+	return ((1ULL << STP_HIST_SUB_BITS) | sub) << (e - 1);
+}
+
+void stp_hist_add(struct stp_hist *h, uint64_t value)
+{
+	if (h->count == 0 || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->count++;
+	h->buckets[stp_hist_bucket(value)]++;
+}
+
+/*
+ * Returns the lowest value of the bucket holding the given percentile, but
+ * the exact minimum and maximum at 0 and 100.
+ */
+uint64_t stp_hist_percentile(const struct stp_hist *h, unsigned int pct)
+{
+	uint64_t rank, seen = 0;
+	size_t k;
+
+	if (h->count == 0)
+		return 0;
+	if (pct == 0)
+		return h->min;
+	if (pct >= 100)
+		return h->max;
+
+	rank = (h->count * pct + 99) / 100;
+	for (k = 0; k < STP_HIST_BUCKETS; k++) {
+		seen += h->buckets[k];
+		if (seen >= rank)
+			break;
+	}
+
+	return stp_hist_value(k) > h->min ? stp_hist_value(k) : h->min;
+}
+
+static void stp_stats_src_add(struct stp_stats_src *src, uint64_t cycles,
+			      size_t len)
+{
+	if (src->pkts > 0)
+		stp_hist_add(&src->gaps, cycles - src->last);
+	src->last = cycles;
+	src->pkts++;
+	src->bytes += len;
+}
+
+static int stp_stats_on_packet(void *ctx, const char *data, size_t len,
+			       int timestamp)
+{
+	struct stp_stats_t *st = ctx;
+
+	st->cycles += timestamp;
+	st->pkts++;
+	st->bytes += len;
+	stp_stats_src_add(&st->channels[st->channel], st->cycles, len);
+	stp_stats_src_add(&st->masters[st->master], st->cycles, len);
+
+	return 0;
+}
+
+static int stp_stats_on_channel(void *ctx, unsigned char channel)
+{
+	/* 0xff means no channel, as in packet lists */
+	if (channel != 0xff)
+		((struct stp_stats_t *) ctx)->channel = channel;
+
+	return 0;
+}
+
+static int stp_stats_on_master(void *ctx, unsigned char master)
+{
+	((struct stp_stats_t *) ctx)->master = master;
+
+	return 0;
+}
+
+static int stp_stats_on_overflow(void *ctx, unsigned char data)
+{
+	((struct stp_stats_t *) ctx)->overflows++;
+
+	return 0;
+}
+
+static int stp_stats_on_error(void *ctx, int err, off_t offset)
+{
+	((struct stp_stats_t *) ctx)->errors++;
+
+	return 0;
+}
+
+/*
+ * Gathers the statistics of an ETB buffer.  Payloads are not assembled; the
+ * only allocations are the list of blocks and one buffer to decode them.
+ */
+int stp_stats_raw_etb(char *buf, size_t u8size, struct stp_stats_t *st)
+{
+	struct stp_blocks_t blocks = { NULL, 0, 0, 0 };
+	struct stp_visitor_t v = {
+		.ctx = st,
+		.flags = STP_VISIT_NO_PAYLOAD,
+		.on_packet = stp_stats_on_packet,
+		.on_channel = stp_stats_on_channel,
+		.on_master = stp_stats_on_master,
+		.on_overflow = stp_stats_on_overflow,
+		.on_error = stp_stats_on_error,
+	};
+	int ret = -1;
+
+	memset(st, 0, sizeof(*st));
+	st->channel = 0xff;
+	st->master = 0xff;
+
+	if (stp_find_blocks(buf, u8size, &blocks) == 0 &&
+	    stp_visit_blocks(buf, &blocks, &v) >= 0) {
+		st->blocks = blocks.count;
+		st->syncs = blocks.syncs;
+		ret = 0;
+	}
+
+	stp_free_blocks(&blocks);
+
+	return ret;
+}
+
+/*
+ * Streaming decoder
+ *
+ * STP messages carry their type in their last nibble, so a block can only be
+ * framed once its end is known.  The decoder accumulates incoming bytes and
+ * decodes every block as soon as the sync packet that terminates it has been
+ * received completely.  Bytes that follow the last sync packet (a block still
+ * being received, possibly ending with a partial message) are kept for the
+ * next call.  Feeding a stream in chunks of any size thus gives the same
+ * packets as stp_read_pkts_in_raw_etb() on the whole stream.
+ *
+ * If dec->arena is set, packets are allocated from it and the caller
+ * typically resets the arena once they are processed.  If dec->filter is
+ * set, only the packets on its channels are returned.
+ */
+
+static int stp_decoder_reserve(struct stp_decoder_t *dec, size_t size)
+{
+	char *buf;
+	size_t new_size = dec->size;
+
+	if (size <= dec->size)
+		return 0;
+
+	while (new_size < size)
+		new_size *= 2;
+
+	buf = realloc(dec->buf, new_size);
+	if (buf == NULL) {
+		perror("realloc");
+		return -1;
+	}
+
+	dec->buf = buf;
+	dec->size = new_size;
+
+	return 0;
+}
+
+int stp_decoder_init(struct stp_decoder_t *dec)
+{
+	dec->size = STP_DECODER_BUFSIZE;
+	dec->buf = malloc(dec->size);
+	if (dec->buf == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	dec->len = 0;
+	dec->scan = 0;
+	dec->max_block = STP_DECODER_MAX_BLOCK;
+	dec->arena = NULL;
+	dec->filter = NULL;
+	dec->master = 0xff;
+	dec->gap = 0;
+	dec->gap_off = 0;
+	dec->cuts = 0;
+	dec->dropped = 0;
+
+	return 0;
+}
+
+void stp_decoder_destroy(struct stp_decoder_t *dec)
+{
+	free(dec->buf);
+	dec->buf = NULL;
+	dec->len = dec->size = 0;
+}
+
+static void stp_decoder_drop(struct stp_decoder_t *dec, size_t cut)
+{
+	memmove(dec->buf, &dec->buf[cut], dec->len - cut);
+	dec->len -= cut;
+	dec->scan = dec->scan > cut ? dec->scan - cut : 0;
+}
+
+/*
+ * Decodes the first cut bytes of the pending buffer and keeps the rest.
+ */
+static struct stp_pkt *stp_decoder_consume(struct stp_decoder_t *dec,
+					   size_t cut)
+{
+	struct stp_pkt *pkt_list = NULL;
+
+	if (cut > 0)
+		pkt_list = stp_read_pkts_filtered(dec->buf, cut, dec->arena,
+						  dec->filter, &dec->master);
+	stp_decoder_drop(dec, cut);
+
+	return pkt_list;
+}
+
+/*
+ * Tells that some of the stream was lost before the next chunk (which may
+ * already be in the space given by stp_decoder_space()).  The block in
+ * progress is dropped, and so is the next chunk up to a sync packet, since
+ * messages cannot be framed again before one.
+ */
+void stp_decoder_gap(struct stp_decoder_t *dec)
+{
+	dec->gap = 1;
+	dec->gap_off = dec->len;
+}
+
+/* While in a gap, drops what comes before the next sync packet */
+static void stp_decoder_skip(struct stp_decoder_t *dec)
+{
+	off_t sync_off;
+	size_t sync_len;
+
+	stp_decoder_drop(dec, dec->gap_off);
+	dec->gap_off = 0;
+
+	sync_off = stp_find_sync((uint8_t *) dec->buf, dec->len, 0, &sync_len);
+	if (sync_off >= 0 && sync_off + STP_SYNC_MAX_LEN <= dec->len) {
+		stp_decoder_drop(dec, sync_off + sync_len);
+		dec->gap = 0;
+	} else if (dec->len > STP_SYNC_MAX_LEN) {
+		stp_decoder_drop(dec, dec->len - STP_SYNC_MAX_LEN);
+	}
+}
+
+/*
+ * Returns where the next u8size bytes of the stream can be written, to be
+ * passed to stp_decoder_commit() without a copy, or NULL on error.
+ */
+char *stp_decoder_space(struct stp_decoder_t *dec, size_t u8size)
+{
+	if (stp_decoder_reserve(dec, dec->len + u8size))
+		return NULL;
+
+	return &dec->buf[dec->len];
+}
+
+/*
+ * Appends a chunk of raw ETB data to the stream.
+ * Returns the linked-list of packets of the blocks completed by this chunk,
+ * or NULL if there is none yet.
+ */
+struct stp_pkt *stp_decoder_feed(struct stp_decoder_t *dec,
+				 char *in, size_t u8size)
+{
+	char *space = stp_decoder_space(dec, u8size);
+
+	if (space == NULL)
+		return NULL;
+	memcpy(space, in, u8size);
+
+	return stp_decoder_commit(dec, u8size);
+}
+
+/*
+ * Same as stp_decoder_feed(), for a chunk already written where
+ * stp_decoder_space() told.
+ */
+struct stp_pkt *stp_decoder_commit(struct stp_decoder_t *dec, size_t u8size)
+{
+	off_t head, sync_off;
+	size_t sync_len, cut = 0;
+
+	dec->len += u8size;
+
+	if (dec->gap) {
+		stp_decoder_skip(dec);
+		if (dec->gap)
+			return NULL;
+	}
+
+	/*
+	 * A sync packet is only known to be complete when the 16 bytes it may
+	 * span have been received.  Nothing before dec->scan can start one.
+	 */
+	head = dec->scan;
+	while ((sync_off = stp_find_sync((uint8_t *) dec->buf, dec->len, head,
+					 &sync_len)) >= 0 &&
+	       sync_off + STP_SYNC_MAX_LEN <= dec->len) {
+		cut = sync_off + sync_len;
+		head = cut;
+	}
+
+	if (dec->len > STP_SYNC_MAX_LEN &&
+	    dec->len - STP_SYNC_MAX_LEN > head)
+		dec->scan = dec->len - STP_SYNC_MAX_LEN;
+	else
+		dec->scan = head;
+
+	/*
+	 * Without any sync packet for too long, the block is dropped to bound
+	 * memory usage, and counted: messages are framed from the end of
+	 * their block, which is not known.  The rest of the block is still
+	 * decoded from the next sync packet back.
+	 */
+	if (cut == 0 && dec->len > dec->max_block) {
+		dec->cuts++;
+		dec->dropped += dec->len - STP_SYNC_MAX_LEN;
+		stp_decoder_drop(dec, dec->len - STP_SYNC_MAX_LEN);
+		return NULL;
+	}
+
+	return stp_decoder_consume(dec, cut);
+}
+
+/*
+ * Decodes everything still pending, as the end of the stream.
+ */
+struct stp_pkt *stp_decoder_flush(struct stp_decoder_t *dec)
+{
+	if (dec->gap) {
+		stp_decoder_drop(dec, dec->len);
+		dec->gap_off = 0;
+	}
+	return stp_decoder_consume(dec, dec->len);
+}
+
+/*
+ * Encoder
+ */
+
+#define STP_ENCODER_BUFSIZE	65536
+
+int stp_encoder_init(struct stp_encoder_t *enc)
+{
+	enc->buf = malloc(STP_ENCODER_BUFSIZE);
+	if (enc->buf == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	enc->size = STP_ENCODER_BUFSIZE;
+	enc->u4len = 0;
+	enc->channel = -1;
+	enc->cycles = 0;
+
+	return 0;
+}
+
+void stp_encoder_free(struct stp_encoder_t *enc)
+{
+	free(enc->buf);
+	enc->buf = NULL;
+	enc->size = 0;
+	enc->u4len = 0;
+}
+
+/* Makes room for u4size more nibbles */
+static int stp_encoder_reserve(struct stp_encoder_t *enc, size_t u4size)
+{
+	uint8_t *new_buf;
+	size_t new_size;
+
+	if ((enc->u4len + u4size + 1) / 2 <= enc->size)
+		return 0;
+
+	new_size = 2 * enc->size;
+	while (new_size < (enc->u4len + u4size + 1) / 2)
+		new_size *= 2;
+	new_buf = realloc(enc->buf, new_size);
+	if (new_buf == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	enc->buf = new_buf;
+	enc->size = new_size;
+
+	return 0;
+}
+
+static inline void stp_put_nibble(struct stp_encoder_t *enc, uint8_t v)
+{
+	if (enc->u4len % 2 == 0)
+		enc->buf[enc->u4len / 2] = v & 0xf;
+	else
+		enc->buf[enc->u4len / 2] |= (v & 0xf) << 4;
+	enc->u4len++;
+}
+
+static inline void stp_put_byte(struct stp_encoder_t *enc, uint8_t v)
+{
+	stp_put_nibble(enc, v);
+	stp_put_nibble(enc, v >> 4);
+}
+
+/*
+ * Writes the timestamp as stp_decode_ts() reads it: one byte below 256,
+ * else hb0, 0xe and b1, hb0 being the smallest exponent that can hold it.
+ * Returns the value written.
+ */
+static int stp_put_ts(struct stp_encoder_t *enc, int timestamp)
+{
+	int hb0, base, shift, b1;
+
+	if (timestamp < 0)
+		timestamp = 0;
+	if (timestamp < 256) {
+		stp_put_byte(enc, timestamp);
+		return timestamp;
+	}
+
+	for (hb0 = 0; ; hb0++) {
+		base = hb0 < 7 ? 1 << (7 + hb0) : 1 << hb0;
+		shift = hb0 < 7 ? hb0 : 2 * hb0 - 6;
+		/* larger exponents would overflow an int when decoded */
+		if (hb0 == 14 || timestamp <= base + (255 << shift))
+			break;
+	}
+	b1 = (timestamp - base) >> shift;
+	if (b1 > 255)
+		b1 = 255;
+
+	stp_put_nibble(enc, hb0);
+	stp_put_nibble(enc, 0xe);
+	stp_put_byte(enc, hb0 < 7 ? b1 ^ 0x80 : b1);
+
+	return base + (b1 << shift);
+}
+
+static int stp_put_msg(struct stp_encoder_t *enc, enum stp_msg_format type,
+		       uint32_t data, size_t size, int timestamp)
+{
+	size_t k;
+
+	if (stp_encoder_reserve(enc, 4 + 2 * size + 1))
+		return -1;
+
+	if (stp_msg_table[type].flags & STP_MSG_F_TS)
+		enc->cycles += stp_put_ts(enc, timestamp);
+	for (k = 0; k < size; k++)
+		stp_put_byte(enc, data >> (8 * k));
+	stp_put_nibble(enc, type);
+
+	return 0;
+}
+
+/*
+ * Same as a write of size bytes (1, 2 or 4) to the channel, at its
+ * timestamped address if timestamp >= 0.  A channel message precedes the
+ * data when the channel changes.
+ */
+int stp_encode_write(struct stp_encoder_t *enc, int channel, uint32_t data,
+		     size_t size, int timestamp)
+{
+	static const enum stp_msg_format types[2][5] = {
+		{ 0, STP_D8, STP_D16, 0, STP_D32 },
+		{ 0, STP_D8TS, STP_D16TS, 0, STP_D32TS },
+	};
+
+	if (size != 1 && size != 2 && size != 4)
+		return -1;
+
+	if (channel != enc->channel) {
+		if (stp_put_msg(enc, STP_C8, channel, 1, 0))
+			return -1;
+		enc->channel = channel;
+	}
+
+	return stp_put_msg(enc, types[timestamp >= 0][size], data, size,
+			   timestamp);
+}
+
+int stp_encode_u24_pkt(struct stp_encoder_t *enc, int channel,
+		       uint32_t data, int timestamp)
+{
+	return stp_encode_write(enc, channel, (3 << 24) | (data & 0xffffff), 4,
+				timestamp);
+}
+
+int stp_encode_u32_pkt(struct stp_encoder_t *enc, int channel,
+		       uint32_t data, int timestamp)
+{
+	if (stp_encode_write(enc, channel, data, 4, -1))
+		return -1;
+	return stp_encode_write(enc, channel, 4, 1, timestamp);
+}
+
+/*
+ * Same writes as stm_send_msg_pkt().  The payload is aligned on its address
+ * the same way, except that the aligning writes are skipped when they would
+ * go past its end.
+ */
+ssize_t stp_encode_msg_pkt(struct stp_encoder_t *enc, int channel,
+			   const void *data, size_t len, int timestamp)
+{
+	const uint8_t *p = data, *end = p + len;
+	uint16_t u16;
+	uint32_t u32;
+	int ret;
+
+	if (len >= 255)
+		return -1;
+
+	if ((uintptr_t) p % 2 && p + 3 <= end) {
+		if (stp_encode_write(enc, channel, *p, 1, -1))
+			return -1;
+		p += 1;
+	}
+	if ((uintptr_t) p % 4 && p + 4 <= end) {
+		memcpy(&u16, p, 2);
+		if (stp_encode_write(enc, channel, u16, 2, -1))
+			return -1;
+		p += 2;
+	}
+
+	while (p + 4 <= end) {
+		memcpy(&u32, p, 4);
+		if (stp_encode_write(enc, channel, u32, 4, -1))
+			return -1;
+		p += 4;
+	}
+
+	if (p + 3 == end) {
+		u32 = 0;
+		memcpy(&u32, p, 3);
+		ret = stp_encode_write(enc, channel, (len << 24) | u32, 4,
+				       timestamp);
+	} else if (p + 2 == end) {
+		memcpy(&u16, p, 2);
+		ret = stp_encode_write(enc, channel, u16, 2, -1) ||
+		      stp_encode_write(enc, channel, len, 1, timestamp);
+	} else if (p + 1 == end) {
+		ret = stp_encode_write(enc, channel, (len << 8) | *p, 2,
+				       timestamp);
+	} else {
+		ret = stp_encode_write(enc, channel, len, 1, timestamp);
+	}
+
+	return ret ? -1 : (ssize_t) len;
+}
+
+int stp_encode_master(struct stp_encoder_t *enc, unsigned char master)
+{
+	return stp_put_msg(enc, STP_MASTER, master, 1, 0);
+}
+
+/*
+ * Ends the current block with a sync packet, after padding to a byte.  It
+ * is always 0x01 and 15 bytes of 0x00: a shorter one could not be told from
+ * a channel message to channel 0 right after it.  The channel is sent again
+ * after it.
+ */
+int stp_encode_sync(struct stp_encoder_t *enc)
+{
+	size_t k;
+
+	if (stp_encoder_reserve(enc, 1 + 2 * STP_SYNC_MAX_LEN))
+		return -1;
+
+	if (enc->u4len % 2)
+		stp_put_nibble(enc, 0);
+	stp_put_byte(enc, 0x01);
+	for (k = 1; k < STP_SYNC_MAX_LEN; k++)
+		stp_put_byte(enc, 0x00);
+	enc->channel = -1;
+
+	return 0;
+}
+
+/*
+ * Pads the stream to a multiple of u8align bytes (1, 2 or 4) with channel
+ * messages to 0xff, which the decoder ignores.  Since they take 3 nibbles,
+ * up to 7 of them may be needed.
+ */
+int stp_encode_pad(struct stp_encoder_t *enc, size_t u8align)
+{
+	if (u8align != 1 && u8align != 2 && u8align != 4)
+		return -1;
+	if (stp_encoder_reserve(enc, 3 * 7))
+		return -1;
+
+	while (enc->u4len % (2 * u8align))
+		if (stp_put_msg(enc, STP_C8, 0xff, 1, 0))
+			return -1;
+
+	return 0;
 }
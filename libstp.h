@@ -19,7 +19,11 @@
 #ifndef LIBSTP_H
 #define LIBSTP_H
 
+#include <pthread.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,16 +35,476 @@ struct stp_pkt {
 	size_t len;
 	int timestamp;
 	unsigned char channel;
+	unsigned char master;	/* set by the last master message */
 };
 
 void free_stp_pkt_list(struct stp_pkt *list);
 
+#define STP_ARENA_SLAB_SIZE	(256 * 1024)
+
+struct stp_arena_slab;
+
+/* Packets allocated from an arena are all released by resetting it */
+struct stp_arena_t {
+	struct stp_arena_slab *first, *slab;
+	size_t used;		/* bytes used in the current slab */
+	size_t slab_size;
+};
+
+int stp_arena_init(struct stp_arena_t *arena, size_t slab_size);
+void stp_arena_reset(struct stp_arena_t *arena);
+void stp_arena_destroy(struct stp_arena_t *arena);
+
 struct stp_pkt *stp_read_pkts(char *in, size_t size);
 size_t stp_count_pkts(char *in, size_t u8size);
 
+/* The length of a packet is coded on one byte */
+#define STP_PKT_MAX_LEN		255
+
+#define STP_ERR_UNKNOWN_MSG	1
+#define STP_ERR_TRUNCATED	2
+#define STP_ERR_OVERFLOW_LEFT	3
+#define STP_ERR_NOMEM		4
+
+const char *stp_strerror(int err);
+
+/*
+ * Channel filter.  Packets on channels not in the mask are skipped without
+ * assembling their payload, and their time is added to the next reported
+ * packet, which is preceded by a call to on_channel with the channel in
+ * effect.  Time sync packets are always reported.  The channel set by the
+ * last channel message is kept across blocks.
+ */
+struct stp_filter_t {
+	uint64_t mask[4];
+	unsigned char channel;	/* channel in effect */
+	/* packets skipped since the last reported one, and their time */
+	unsigned int skipped;
+	int skipped_ts;
+};
+
+void stp_filter_init(struct stp_filter_t *f);
+void stp_filter_add(struct stp_filter_t *f, unsigned int first,
+		    unsigned int last);
+int stp_filter_parse(struct stp_filter_t *f, const char *list);
+
+static inline int stp_filter_match(const struct stp_filter_t *f,
+				   unsigned char channel)
+{
+	return (f->mask[channel >> 6] >> (channel & 63)) & 1;
+}
+
+/* Packets are reported without their payload (data is NULL) */
+#define STP_VISIT_NO_PAYLOAD	(1 << 0)
+/*
+ * Only on_packet and on_error are called, packets come without payload and
+ * those of a block are reported latest first.  This saves the forward pass
+ * over the block, for counting.
+ */
+#define STP_VISIT_UNORDERED	(1 << 1)
+
+/*
+ * Unless STP_VISIT_UNORDERED is set, visitors are called in chronological
+ * order.  Callbacks may be NULL.  A callback returning non-zero stops
+ * decoding, and the stp_visit_*() function returns that value.  The payload
+ * passed to on_packet is only valid during the call.
+ */
+struct stp_visitor_t {
+	void *ctx;
+	unsigned int flags;
+	int (*on_packet)(void *ctx, const char *data, size_t len,
+			 int timestamp);
+	int (*on_channel)(void *ctx, unsigned char channel);
+	int (*on_master)(void *ctx, unsigned char master);
+	int (*on_overflow)(void *ctx, unsigned char data);
+	int (*on_error)(void *ctx, int err, off_t offset);
+	struct stp_filter_t *filter;	/* NULL to report all channels */
+};
+
+int stp_visit_block(char *in, size_t u8size, struct stp_visitor_t *v);
+
+struct stp_block {
+	off_t off;
+	size_t len;
+};
+
+/* Blocks of an ETB buffer, between sync packets */
+struct stp_blocks_t {
+	struct stp_block *blocks;
+	size_t count, size;
+	size_t syncs;		/* number of sync packets */
+};
+
+int stp_find_blocks(char *buf, size_t u8size, struct stp_blocks_t *blocks);
+void stp_free_blocks(struct stp_blocks_t *blocks);
+
+int stp_visit_blocks(char *buf, struct stp_blocks_t *blocks,
+		     struct stp_visitor_t *v);
+int stp_visit_raw_etb(char *buf, size_t u8size, struct stp_visitor_t *v);
+
+struct stp_pkt *stp_read_pkts_in_blocks(char *buf, struct stp_blocks_t *blocks,
+					struct stp_arena_t *arena);
+size_t stp_count_pkts_in_blocks(char *buf, struct stp_blocks_t *blocks);
+
 struct stp_pkt *stp_read_pkts_in_raw_etb(char *buf, size_t u8size);
+struct stp_pkt *stp_read_pkts_in_raw_etb_arena(char *buf, size_t u8size,
+					       struct stp_arena_t *arena);
 size_t stp_count_pkts_in_raw_etb(char *buf, size_t u8size);
 
+/*
+ * Packet arrays: one descriptor per packet, in chronological order.
+ * Payloads are either in the input buffer (STP_PKT_IN_INPUT) or in the
+ * packed heap of the array.
+ */
+#define STP_PKT_IN_INPUT	(1 << 0)
+
+struct stp_pkt_desc {
+	uint64_t cycles;	/* sum of timestamps since the first buffer */
+	size_t offset;		/* of the payload, in the input or the heap */
+	size_t len;
+	int timestamp;
+	unsigned char channel;	/* channel in effect */
+	unsigned char master;	/* master in effect */
+	unsigned char flags;
+};
+
+struct stp_pkt_array_t {
+	struct stp_pkt_desc *pkts;
+	size_t count, size;
+	char *heap;
+	size_t heap_len, heap_size;
+	const char *in;		/* input buffer */
+	size_t in_len;
+	uint64_t cycles;	/* carried from one buffer to the next */
+	unsigned char channel;
+	unsigned char master;
+};
+
+int stp_pkt_array_init(struct stp_pkt_array_t *arr);
+void stp_pkt_array_free(struct stp_pkt_array_t *arr);
+
+int stp_read_pkt_array(char *buf, size_t u8size, struct stp_pkt_array_t *arr);
+
+static inline const char *stp_pkt_array_data(struct stp_pkt_array_t *arr,
+					     size_t i)
+{
+	return (arr->pkts[i].flags & STP_PKT_IN_INPUT ? arr->in : arr->heap)
+	       + arr->pkts[i].offset;
+}
+
+size_t stp_pkt_array_find(struct stp_pkt_array_t *arr, uint64_t cycles);
+int stp_pkt_array_iovec(struct stp_pkt_array_t *arr, size_t first, size_t n,
+			struct iovec *iov);
+
+/*
+ * Pool of threads decoding the blocks of a buffer in parallel.  Each worker
+ * starts with a contiguous range of blocks and steals from the others once
+ * it is done, so that uneven blocks do not leave threads idle.
+ */
+struct stp_pool_worker;
+struct stp_pool_block;
+
+struct stp_pool_t {
+	int nthreads;
+	pthread_t *threads;
+	struct stp_pool_worker *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned long job;	/* incremented for each job */
+	int running;		/* workers not done with the job */
+	int quit;
+	/* current job */
+	char *buf;
+	struct stp_blocks_t *blocks;
+	struct stp_pool_block *results;
+	size_t results_size;
+};
+
+int stp_pool_init(struct stp_pool_t *pool, int nthreads);
+void stp_pool_destroy(struct stp_pool_t *pool);
+int stp_pool_read_pkt_array(struct stp_pool_t *pool, char *buf,
+			    struct stp_blocks_t *blocks,
+			    struct stp_pkt_array_t *arr);
+
+/*
+ * Time sync packet written by the target: STP_TIME_MAGICK followed by its
+ * 32-bit struct timeval.
+ */
+#define STP_TIME_MAGICK		('t' | 'i'<<8 | 'm'<<16 | 'e'<<24)
+#define STP_TIME_SYNC_LEN	12
+
+static inline int stp_is_time_sync(const char *data, size_t len)
+{
+	uint32_t magic;
+
+	if (len != STP_TIME_SYNC_LEN)
+		return 0;
+	memcpy(&magic, data, 4);
+	return magic == STP_TIME_MAGICK;
+}
+
+/*
+ * Timeline: absolute time of each packet, in nanoseconds, rebuilt from the
+ * timestamps and anchored at every time sync packet.  Only integers are
+ * used, so that the time is exact and the same for every consumer.
+ */
+#define STP_NSEC_PER_SEC	1000000000ULL
+
+/*
+ * Clock calibration: the time sync packets of a trace, and the frequency of
+ * the timestamps fitted on them by least squares, updated as they come.
+ */
+struct stp_anchor {
+	uint64_t cycles;
+	int64_t ns;
+};
+
+struct stp_calib_t {
+	struct stp_anchor *anchors;
+	size_t count, size;
+	/* running means and co-moments, relative to the first anchor */
+	double mean_x, mean_y;
+	double cxx, cxy, cyy;
+	/* set by stp_calib_fit() */
+	double freq;		/* in Hz */
+	double rms_ns, max_ns;	/* residual error of the anchors */
+};
+
+void stp_calib_init(struct stp_calib_t *cal);
+void stp_calib_free(struct stp_calib_t *cal);
+int stp_calib_add(struct stp_calib_t *cal, uint64_t cycles, int64_t ns);
+int stp_calib_scan(char *buf, size_t u8size, struct stp_calib_t *cal);
+int stp_calib_fit(struct stp_calib_t *cal);
+
+/*
+ * A cycle lasts mult + num / den ns, den staying below 2^32 for products to
+ * fit in 64 bits.  Without calibration, that is 10^9 / freq.  With it, the
+ * time is interpolated linearly from one time sync packet to the next, and
+ * extrapolated after the last one with the fitted frequency.
+ */
+struct stp_timeline_t {
+	uint32_t freq;		/* nominal, of the timestamp counter, in Hz */
+	uint64_t mult, num, den;
+	struct stp_calib_t *calib;	/* if set */
+	uint64_t cycles;	/* since the beginning of the trace */
+	int64_t ns;		/* time of the last packet, rounded down */
+	uint64_t rem;		/* rest of it, in 1/den ns */
+	uint64_t sync_cycles;	/* cycles at the last time sync packet */
+	int64_t sync_ns;	/* its time, 0 before the first one */
+	int64_t drift_ns;	/* its time minus the one expected */
+	uint64_t syncs;		/* time sync packets seen */
+};
+
+void stp_timeline_init(struct stp_timeline_t *tl, uint32_t freq);
+void stp_timeline_calibrate(struct stp_timeline_t *tl,
+			    struct stp_calib_t *cal);
+void stp_timeline_seek(struct stp_timeline_t *tl, uint64_t cycles,
+		       uint64_t sync_cycles, int64_t sync_ns);
+void stp_timeline_anchor(struct stp_timeline_t *tl, const char *data);
+int64_t stp_timeline_cycles_ns(struct stp_timeline_t *tl, uint64_t cycles);
+
+/*
+ * Advances the timeline to a packet, whose time is then in tl->ns.
+ * Returns 1 if it is a time sync packet, which the timeline is anchored at.
+ */
+static inline int stp_timeline_update(struct stp_timeline_t *tl,
+				      const char *data, size_t len,
+				      int timestamp)
+{
+	tl->cycles += timestamp;
+	if (timestamp != 0) {
+		tl->rem += (uint64_t) timestamp * tl->num;
+		tl->ns += timestamp * tl->mult + tl->rem / tl->den;
+		tl->rem %= tl->den;
+	}
+
+	if (!stp_is_time_sync(data, len))
+		return 0;
+	stp_timeline_anchor(tl, data);
+	return 1;
+}
+
+/*
+ * Index of a trace, saved next to it, to start decoding at any block with
+ * the state the previous blocks leave.
+ */
+#define STP_INDEX_MAGIC		"STPX"
+#define STP_INDEX_VERSION	2
+
+struct stp_index_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t trace_size;	/* to detect a stale index */
+	int64_t trace_mtime;
+	uint64_t count;		/* number of entries */
+	uint64_t pkts;		/* total number of packets */
+	uint64_t cycles;	/* total number of cycles */
+};
+
+/* State at the beginning of a block */
+struct stp_index_entry {
+	uint64_t off, len;
+	uint64_t pkts;		/* packets before the block */
+	uint64_t cycles;	/* cycles before the block */
+	uint64_t sync_cycles;	/* cycles at the last time sync packet */
+	uint32_t sync_sec, sync_usec;	/* its time, if has_sync */
+	uint32_t count;		/* packets in the block */
+	unsigned char channel;	/* last channel set */
+	unsigned char has_sync;
+	unsigned char master;	/* last master set */
+	unsigned char pad;
+};
+
+struct stp_index_t {
+	struct stp_index_header hdr;
+	struct stp_index_entry *entries;
+	size_t size;
+	void *map;		/* set if loaded from a file */
+	size_t map_len;
+};
+
+int stp_index_build(char *buf, size_t u8size, struct stp_index_t *idx);
+int stp_index_save(struct stp_index_t *idx, const char *path);
+int stp_index_load(struct stp_index_t *idx, const char *path);
+void stp_index_free(struct stp_index_t *idx);
+size_t stp_index_find_pkt(struct stp_index_t *idx, uint64_t pkt);
+size_t stp_index_find_cycles(struct stp_index_t *idx, uint64_t cycles);
+
+/*
+ * Statistics of a trace, gathered in one pass without allocating per packet.
+ * Inter-arrival times are kept in log-linear histograms, as in HDR
+ * histograms: below 2^STP_HIST_SUB_BITS each value has its bucket, above,
+ * every power of two is split into 2^STP_HIST_SUB_BITS buckets, so that
+ * values are known within 1/2^STP_HIST_SUB_BITS.  Values from
+ * 2^STP_HIST_MAX_BITS on all go to the last bucket.
+ */
+#define STP_HIST_SUB_BITS	4
+#define STP_HIST_MAX_BITS	40
+#define STP_HIST_BUCKETS \
+	((STP_HIST_MAX_BITS - STP_HIST_SUB_BITS + 1) << STP_HIST_SUB_BITS)
+
+struct stp_hist {
+	uint64_t count;
+	uint64_t min, max;
+	uint32_t buckets[STP_HIST_BUCKETS];
+};
+
+void stp_hist_add(struct stp_hist *h, uint64_t value);
+uint64_t stp_hist_percentile(const struct stp_hist *h, unsigned int pct);
+
+/* Packets of one channel or master */
+struct stp_stats_src {
+	uint64_t pkts, bytes;
+	uint64_t last;		/* cycles at the last packet */
+	struct stp_hist gaps;	/* cycles between packets */
+};
+
+struct stp_stats_t {
+	struct stp_stats_src channels[256];
+	struct stp_stats_src masters[256];
+	uint64_t pkts, bytes, cycles;
+	size_t blocks, syncs;	/* blocks, and sync packets around them */
+	uint64_t overflows, errors;
+	unsigned char channel, master;	/* in effect */
+};
+
+int stp_stats_raw_etb(char *buf, size_t u8size, struct stp_stats_t *st);
+
+/*
+ * Binary output of stpdecode: a header, the payloads packed one after the
+ * other, then fixed-size records, 8-byte aligned, that can be used in place
+ * once the file is mapped.
+ */
+#define STP_BIN_MAGIC		"STPB"
+#define STP_BIN_VERSION		1
+
+struct stp_bin_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t count;		/* number of records */
+	uint64_t records;	/* offset of the records in the file */
+	uint64_t heap;		/* offset of the payloads in the file */
+	uint64_t heap_len;
+};
+
+/* The payload is STP_TIME_MAGICK and the time of the target */
+#define STP_BIN_TIME_SYNC	(1 << 0)
+
+struct stp_bin_record {
+	int64_t time_ns;	/* rebuilt from the time sync packets */
+	uint64_t cycles;	/* since the beginning of the trace */
+	uint64_t offset;	/* of the payload, from the heap */
+	uint16_t len;
+	unsigned char channel;
+	unsigned char master;
+	uint32_t flags;
+};
+
+/* A sync packet is 0x01 followed by up to 15 bytes of 0x00 */
+#define STP_SYNC_MAX_LEN	16
+
+#define STP_DECODER_BUFSIZE	4096
+#define STP_DECODER_MAX_BLOCK	(1024 * 1024)
+
+struct stp_decoder_t {
+	char *buf;		/* received bytes not decoded yet */
+	size_t len, size;
+	off_t scan;		/* no sync packet starts before this offset */
+	size_t max_block;	/* bytes kept at most without a sync packet */
+	struct stp_arena_t *arena; /* where packets are allocated, if set */
+	struct stp_filter_t *filter; /* channels to decode, if set */
+	unsigned char master;	/* carried from one block to the next */
+	int gap;		/* skipping to the next sync packet */
+	size_t gap_off;		/* bytes received before the gap */
+	uint64_t cuts;		/* blocks longer than max_block, dropped */
+	uint64_t dropped;	/* bytes of them */
+};
+
+int stp_decoder_init(struct stp_decoder_t *dec);
+void stp_decoder_destroy(struct stp_decoder_t *dec);
+void stp_decoder_gap(struct stp_decoder_t *dec);
+
+struct stp_pkt *stp_decoder_feed(struct stp_decoder_t *dec,
+				 char *in, size_t u8size);
+char *stp_decoder_space(struct stp_decoder_t *dec, size_t u8size);
+struct stp_pkt *stp_decoder_commit(struct stp_decoder_t *dec, size_t u8size);
+struct stp_pkt *stp_decoder_flush(struct stp_decoder_t *dec);
+
+/*
+ * Software encoder: writes the STP stream that the STM emits for the
+ * stm_send_*() functions of libstm, as the decoder reads it, so that traces
+ * can be made without a target.  Timestamps are given by the caller, in
+ * cycles since the previous timestamped message; those that do not fit in
+ * one byte are rounded down to what a 2-byte timestamp can hold.
+ */
+struct stp_encoder_t {
+	uint8_t *buf;
+	size_t u4len;		/* nibbles written */
+	size_t size;		/* bytes allocated */
+	int channel;		/* last channel sent, -1 after a sync packet */
+	uint64_t cycles;	/* sum of the timestamps written */
+};
+
+int stp_encoder_init(struct stp_encoder_t *enc);
+void stp_encoder_free(struct stp_encoder_t *enc);
+
+static inline size_t stp_encoder_len(struct stp_encoder_t *enc)
+{
+	return (enc->u4len + 1) / 2;
+}
+
+int stp_encode_write(struct stp_encoder_t *enc, int channel, uint32_t data,
+		     size_t size, int timestamp);
+int stp_encode_u24_pkt(struct stp_encoder_t *enc, int channel,
+		       uint32_t data, int timestamp);
+int stp_encode_u32_pkt(struct stp_encoder_t *enc, int channel,
+		       uint32_t data, int timestamp);
+ssize_t stp_encode_msg_pkt(struct stp_encoder_t *enc, int channel,
+			   const void *data, size_t len, int timestamp);
+int stp_encode_master(struct stp_encoder_t *enc, unsigned char master);
+int stp_encode_sync(struct stp_encoder_t *enc);
+int stp_encode_pad(struct stp_encoder_t *enc, size_t u8align);
+
 #ifdef __cplusplus
 }
 #endif
@@ -73,6 +73,8 @@ int main(int argc, char **argv)
 		printf("error: couldn't open STM\n");
 		goto end;
 	}
+	/* Unlocked once for the configuration and the flush */
+	stm_begin(&stm_handle);
 	if (stm_config_for_etb(&stm_handle)) {
 		printf("error: couldn't configure STM for ETB\n");
 		goto end;
@@ -82,6 +84,7 @@ int main(int argc, char **argv)
 		stm_send_msg_pkt(&stm_handle, channel, buf, n);
 
 	stm_flush(&stm_handle);
+	stm_end(&stm_handle);
 	stm_close(&stm_handle);
 end:
 	if (argc == 2)
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2013 - Adrien Vergé <adrienverge@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <signal.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libstp.h"
+
+#define MAX_CHANNELS	256
+
+void usage(char *prog)
+{
+	printf("usage: %s [-n PACKETS] [-l MINLEN-MAXLEN] [-c CHANNELS]\n"
+	       "       [-s PACKETS_PER_BLOCK] [-t MAX_TIMESTAMP] [-m msg|u24|u32|mix]\n"
+	       "       [-r RUNS] [-S SEED] [-o OUTPUTFILE]\n"
+	       "Encodes a synthetic STP trace, then measures the decoder on it.\n"
+	       "With -o, the trace is saved and nothing is measured.\n", prog);
+}
+
+struct workload {
+	unsigned long pkts;
+	size_t min_len, max_len;
+	int channels;
+	unsigned long per_block;
+	int max_ts;
+	int mode;		/* 0: msg, 1: u24, 2: u32, 3: mix */
+};
+
+static int encode(struct stp_encoder_t *enc, struct workload *w)
+{
+	char payload[STP_PKT_MAX_LEN];
+	unsigned long i;
+	size_t len, k;
+	int channel, ts, mode, ret;
+
+	for (i = 0; i < w->pkts; i++) {
+		channel = rand() % w->channels;
+		ts = w->max_ts > 0 ? rand() % w->max_ts + 1 : 0;
+		mode = w->mode == 3 ? rand() % 3 : w->mode;
+
+		if (mode == 1) {
+			ret = stp_encode_u24_pkt(enc, channel, rand(), ts);
+		} else if (mode == 2) {
+			ret = stp_encode_u32_pkt(enc, channel, rand(), ts);
+		} else {
+			len = w->min_len + rand() % (w->max_len - w->min_len + 1);
+			for (k = 0; k < len; k++)
+				payload[k] = 'a' + (i + k) % 26;
+			ret = stp_encode_msg_pkt(enc, channel, payload, len,
+						 ts) < 0;
+		}
+		if (ret)
+			return -1;
+
+		if ((i + 1) % w->per_block == 0 && stp_encode_sync(enc))
+			return -1;
+	}
+
+	return stp_encode_sync(enc);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double secs, size_t bytes,
+		   unsigned long pkts)
+{
+	printf("%-26s %9.1f MB/s %9.2f Mpkts/s\n", name,
+	       bytes / secs / 1e6, pkts / secs / 1e6);
+}
+
+/*
+ * Each benchmark is run several times, and the best time is kept.
+ */
+static int bench(char *buf, size_t size, unsigned long pkts, int runs)
+{
+	struct stp_blocks_t blocks;
+	struct stp_pkt_array_t arr;
+	struct stp_pkt *list, *pkt;
+	double start, t, best;
+	size_t n = 0;
+	int r;
+
+	best = 1e9;
+	for (r = 0; r < runs; r++) {
+		memset(&blocks, 0, sizeof(blocks));
+		start = now();
+		if (stp_find_blocks(buf, size, &blocks))
+			return -1;
+		t = now() - start;
+		if (t < best)
+			best = t;
+		stp_free_blocks(&blocks);
+	}
+	report("stp_find_blocks", best, size, pkts);
+
+	best = 1e9;
+	for (r = 0; r < runs; r++) {
+		start = now();
+		n = stp_count_pkts_in_raw_etb(buf, size);
+		t = now() - start;
+		if (t < best)
+			best = t;
+	}
+	report("stp_count_pkts", best, size, pkts);
+	if (n != pkts)
+		fprintf(stderr, "warning: counted %zu packets, %lu sent\n",
+			n, pkts);
+
+	best = 1e9;
+	for (r = 0; r < runs; r++) {
+		start = now();
+		list = stp_read_pkts_in_raw_etb(buf, size);
+		for (n = 0, pkt = list; pkt != NULL; pkt = pkt->next)
+			n++;
+		free_stp_pkt_list(list);
+		t = now() - start;
+		if (t < best)
+			best = t;
+	}
+	report("stp_read_pkts", best, size, pkts);
+	if (n != pkts)
+		fprintf(stderr, "warning: read %zu packets, %lu sent\n",
+			n, pkts);
+
+	if (stp_pkt_array_init(&arr))
+		return -1;
+	best = 1e9;
+	for (r = 0; r < runs; r++) {
+		start = now();
+		arr.count = 0;
+		arr.heap_len = 0;
+		if (stp_read_pkt_array(buf, size, &arr))
+			break;
+		t = now() - start;
+		if (t < best)
+			best = t;
+	}
+	report("stp_read_pkt_array", best, size, pkts);
+	if (arr.count != pkts)
+		fprintf(stderr, "warning: read %zu packets, %lu sent\n",
+			arr.count, pkts);
+	stp_pkt_array_free(&arr);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = EXIT_FAILURE;
+	int c;
+	int runs = 5;
+	char *output = NULL;
+	FILE *out;
+	struct stp_encoder_t enc;
+	struct workload w = {
+		.pkts = 1000000,
+		.min_len = 1,
+		.max_len = 64,
+		.channels = 4,
+		.per_block = 64,
+		.max_ts = 200,
+		.mode = 0,
+	};
+
+	srand(1);
+
+	while ((c = getopt(argc, argv, "hn:l:c:s:t:m:r:S:o:")) != -1)
+		switch (c) {
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'n':
+			w.pkts = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			if (sscanf(optarg, "%zu-%zu", &w.min_len,
+				   &w.max_len) != 2)
+				w.min_len = w.max_len = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			w.channels = atoi(optarg);
+			break;
+		case 's':
+			w.per_block = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			w.max_ts = atoi(optarg);
+			break;
+		case 'm':
+			if (strcmp(optarg, "msg") == 0)
+				w.mode = 0;
+			else if (strcmp(optarg, "u24") == 0)
+				w.mode = 1;
+			else if (strcmp(optarg, "u32") == 0)
+				w.mode = 2;
+			else if (strcmp(optarg, "mix") == 0)
+				w.mode = 3;
+			else
+				w.mode = -1;
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'S':
+			srand(atoi(optarg));
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case '?':
+		default:
+			usage(argv[0]);
+			goto end;
+		}
+
+	if (optind != argc || w.min_len > w.max_len ||
+	    w.max_len >= STP_PKT_MAX_LEN || w.channels < 1 ||
+	    w.channels > MAX_CHANNELS || w.per_block < 1 || w.mode < 0 ||
+	    runs < 1) {
+		usage(argv[0]);
+		goto end;
+	}
+
+	if (stp_encoder_init(&enc))
+		goto end;
+	if (encode(&enc, &w)) {
+		fprintf(stderr, "error: couldn't encode the trace\n");
+		goto free_encoder;
+	}
+
+	if (output != NULL) {
+		out = fopen(output, "w");
+		if (out == NULL) {
+			perror("fopen");
+			goto free_encoder;
+		}
+		if (fwrite(enc.buf, 1, stp_encoder_len(&enc), out) !=
+		    stp_encoder_len(&enc))
+			perror("fwrite");
+		else
+			ret = EXIT_SUCCESS;
+		fclose(out);
+		goto free_encoder;
+	}
+
+	printf("%lu packets, %zu bytes, %lu per block, %d channels\n",
+	       w.pkts, stp_encoder_len(&enc), w.per_block, w.channels);
+	if (bench((char *) enc.buf, stp_encoder_len(&enc), w.pkts, runs) == 0)
+		ret = EXIT_SUCCESS;
+
+free_encoder:
+	stp_encoder_free(&enc);
+end:
+	exit(ret);
+}
@@ -16,7 +16,11 @@
  */
 
 #include <signal.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,15 +32,710 @@
 
 #include "libstp.h"
 
-#define BUFSIZE 512
+#define CHUNKSIZE 65536
+#define OUTBUFSIZE (1024 * 1024)
+/* "[" + the longest time + "] [xx] " */
+#define LINE_HEADER_MAX (1 + 20 + 7)
+#define PARALLEL_CHUNKSIZE (1024 * 1024)
 
-#define TIME_MAGICK ('t' | 'i'<<8 | 'm'<<16 | 'e'<<24)
-#define OMAP4430_FREQ	133400000.0 // ??
-#define timeval2double(tv) ((double) tv.tv_sec + (double) tv.tv_usec/1000000.0)
+#define OPT_COUNT	256
+#define OPT_TO		257
+#define OPT_FORMAT	258
+#define OPT_CALIBRATE	259
+#define OPT_SPLIT_DIR	260
+#define OPT_STATS	261
+
+#define SPLIT_BUFSIZE	16384
+#define SPLIT_MAX_OPEN	64
+
+#define OMAP4430_FREQ	133400000 // ??
 
 void usage(char *prog)
 {
-	printf("usage: %s [-c] INPUTFILE\n", prog);
+	printf("usage: %s [-c] [--stats] [-x] [-j THREADS] [-C CHANNELS] [-n|--first N]\n"
+	       "       [--count N] [-t|--from TIME] [--to TIME] [--format=text|bin]\n"
+	       "       [--calibrate] [--split-dir DIR] INPUTFILE\n"
+	       "CHANNELS is a list such as 10,11,40-47\n"
+	       "TIME is in seconds, or in cycles from the beginning of the trace "
+	       "if followed by 'c'\n", prog);
+}
+
+/*
+ * Output split by channel: lines of each channel are buffered apart, and
+ * written to DIR/chXX.txt when the buffer is full.  Files are opened on
+ * their first write, and at most SPLIT_MAX_OPEN are kept open, the least
+ * recently written being closed first.
+ */
+struct split_writer {
+	char *buf;		/* NULL until the channel has output */
+	size_t len;
+	int fd;			/* -1 if closed */
+	int created;
+	uint64_t last_write;
+};
+
+struct split_state {
+	const char *dir;
+	struct split_writer ch[256];
+	int open;		/* number of open files */
+	uint64_t writes;
+};
+
+/*
+ * Time and channel carry over from one packet to the next, so they are kept
+ * across calls.
+ */
+struct print_state {
+	struct stp_timeline_t tl;
+	unsigned char channel;
+	unsigned char master;
+	uint64_t pkt_no;	/* number of the next packet */
+	/* only packets in this window are printed */
+	uint64_t first;
+	uint64_t left;		/* packets still to print */
+	int64_t from, to;	/* in ns */
+	uint64_t from_cycles, to_cycles;
+	struct stp_filter_t *filter;	/* channels to print, if set */
+	/* binary output, if set */
+	FILE *records;		/* written after the payloads at the end */
+	struct stp_bin_header hdr;
+	struct split_state *split;	/* output split by channel, if set */
+	int error;
+};
+
+/*
+ * Binary output: payloads go to stdout as they come, and records to a
+ * temporary file, appended to stdout at the end.
+ */
+static int bin_start(struct print_state *st)
+{
+	struct stat out;
+
+	if (fstat(STDOUT_FILENO, &out) == -1 || !S_ISREG(out.st_mode)) {
+		fprintf(stderr, "error: binary output must be a file\n");
+		return -1;
+	}
+
+	st->records = tmpfile();
+	if (st->records == NULL) {
+		perror("tmpfile");
+		return -1;
+	}
+
+	memcpy(st->hdr.magic, STP_BIN_MAGIC, 4);
+	st->hdr.version = STP_BIN_VERSION;
+	st->hdr.heap = sizeof(st->hdr);
+	fwrite(&st->hdr, sizeof(st->hdr), 1, stdout);
+
+	return 0;
+}
+
+static void bin_write(struct print_state *st, const char *data, size_t len,
+		      uint32_t flags)
+{
+	struct stp_bin_record rec;
+
+	rec.time_ns = st->tl.ns;
+	rec.cycles = st->tl.cycles;
+	rec.offset = st->hdr.heap_len;
+	rec.len = len;
+	rec.channel = st->channel;
+	rec.master = st->master;
+	rec.flags = flags;
+
+	fwrite(data, 1, len, stdout);
+	fwrite(&rec, sizeof(rec), 1, st->records);
+	st->hdr.heap_len += len;
+	st->hdr.count++;
+}
+
+static int bin_finish(struct print_state *st)
+{
+	static const char zeros[8];
+	char buf[65536];
+	size_t n;
+
+	st->hdr.records = (st->hdr.heap + st->hdr.heap_len + 7) & ~7ULL;
+	fwrite(zeros, 1, st->hdr.records - st->hdr.heap - st->hdr.heap_len,
+	       stdout);
+
+	rewind(st->records);
+	while ((n = fread(buf, 1, sizeof(buf), st->records)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(st->records);
+
+	if (fflush(stdout) ||
+	    pwrite(STDOUT_FILENO, &st->hdr, sizeof(st->hdr), 0) == -1) {
+		perror("write");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parses a time in seconds, with up to 9 decimals, into ns, or in cycles if
+ * followed by 'c'.
+ */
+static int parse_time(const char *arg, int64_t *ns, uint64_t *cycles)
+{
+	uint64_t sec, frac = 0, unit = STP_NSEC_PER_SEC;
+	char *end;
+
+	if (strchr(arg, 'c') != NULL) {
+		*cycles = strtoull(arg, &end, 0);
+		return *end == 'c' && end[1] == '\0' ? 0 : -1;
+	}
+
+	if (*arg < '0' || *arg > '9')
+		return -1;
+	sec = strtoull(arg, &end, 10);
+	if (*end == '.')
+		for (end++; *end >= '0' && *end <= '9' && unit > 1; end++) {
+			unit /= 10;
+			frac += (*end - '0') * unit;
+		}
+	if (*end != '\0' || sec >= INT64_MAX / STP_NSEC_PER_SEC)
+		return -1;
+
+	*ns = sec * STP_NSEC_PER_SEC + frac;
+	return 0;
+}
+
+/*
+ * Text output: lines are formatted into one buffer, written with a single
+ * write() when it is full.
+ */
+static char outbuf[OUTBUFSIZE];
+static size_t outlen;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const uint64_t dec_pow10[19] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+};
+
+static const char dec_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"68697071727374757677787980818283848586878889909192939495969798"
+	"99";
+
+static void out_flush(void)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < outlen) {
+		n = write(STDOUT_FILENO, &outbuf[done], outlen - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			break;
+		}
+		done += n;
+	}
+	outlen = 0;
+}
+
+/* Returns where to format a line of at most len bytes */
+static inline char *out_reserve(size_t len)
+{
+	if (outlen + len > OUTBUFSIZE)
+		out_flush();
+	return &outbuf[outlen];
+}
+
+/* Writes n with exactly ndigits digits, right to left */
+static inline void format_digits(char *end, uint64_t n, int ndigits)
+{
+	for (; ndigits >= 2; ndigits -= 2) {
+		end -= 2;
+		memcpy(end, &dec_pairs[2 * (n % 100)], 2);
+		n /= 100;
+	}
+	if (ndigits)
+		*--end = '0' + n % 10;
+}
+
+/*
+ * Formats a time in ns as seconds with 8 decimals, rounded to nearest.
+ */
+static char *format_ts(char *p, int64_t ns)
+{
+	uint64_t sec, frac;
+	int ndigits;
+
+	if (ns < 0)
+		return p + sprintf(p, "%2.8f", ns / 1e9);
+
+	sec = ns / STP_NSEC_PER_SEC;
+	frac = (ns % STP_NSEC_PER_SEC + 5) / 10;
+	if (frac == 100000000) {
+		frac = 0;
+		sec++;
+	}
+
+	for (ndigits = 1; ndigits < 19 && sec >= dec_pow10[ndigits]; ndigits++)
+		;
+	format_digits(p + ndigits, sec, ndigits);
+	p += ndigits;
+	*p++ = '.';
+	format_digits(p + 8, frac, 8);
+
+	return p + 8;
+}
+
+/* Formats "[ts] [ch] " */
+static char *format_header(char *p, int64_t ns, unsigned char channel)
+{
+	*p++ = '[';
+	p = format_ts(p, ns);
+	memcpy(p, "] [", 3);
+	p += 3;
+	*p++ = hex_digits[channel >> 4];
+	*p++ = hex_digits[channel & 0xf];
+	*p++ = ']';
+	*p++ = ' ';
+
+	return p;
+}
+
+static int split_start(struct split_state *sp, const char *dir)
+{
+	int k;
+
+	if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+		perror("mkdir");
+		return -1;
+	}
+
+	memset(sp, 0, sizeof(*sp));
+	sp->dir = dir;
+	for (k = 0; k < 256; k++)
+		sp->ch[k].fd = -1;
+
+	return 0;
+}
+
+static void split_close_lru(struct split_state *sp)
+{
+	struct split_writer *lru = NULL;
+	int k;
+
+	for (k = 0; k < 256; k++)
+		if (sp->ch[k].fd != -1 &&
+		    (lru == NULL || sp->ch[k].last_write < lru->last_write))
+			lru = &sp->ch[k];
+
+	close(lru->fd);
+	lru->fd = -1;
+	sp->open--;
+}
+
+static int split_flush(struct split_state *sp, unsigned char channel)
+{
+	struct split_writer *w = &sp->ch[channel];
+	char path[PATH_MAX];
+	size_t done = 0;
+	ssize_t n;
+
+	if (w->len == 0)
+		return 0;
+
+	if (w->fd == -1) {
+		if (sp->open >= SPLIT_MAX_OPEN)
+			split_close_lru(sp);
+		snprintf(path, sizeof(path), "%s/ch%02x.txt", sp->dir, channel);
+		w->fd = open(path, O_WRONLY | O_CREAT |
+			     (w->created ? O_APPEND : O_TRUNC), 0666);
+		if (w->fd == -1) {
+			perror("open");
+			return -1;
+		}
+		w->created = 1;
+		sp->open++;
+	}
+
+	while (done < w->len) {
+		n = write(w->fd, &w->buf[done], w->len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		done += n;
+	}
+	w->len = 0;
+	w->last_write = ++sp->writes;
+
+	return 0;
+}
+
+/* Flushes and closes all files.  Returns -1 if any write failed. */
+static int split_finish(struct split_state *sp)
+{
+	int ret = 0;
+	int k;
+
+	for (k = 0; k < 256; k++) {
+		if (split_flush(sp, k))
+			ret = -1;
+		if (sp->ch[k].fd != -1)
+			close(sp->ch[k].fd);
+		free(sp->ch[k].buf);
+	}
+
+	return ret;
+}
+
+static int split_line(struct split_state *sp, int64_t ns,
+		      unsigned char channel, const char *data, size_t len)
+{
+	struct split_writer *w = &sp->ch[channel];
+	char *p;
+
+	if (w->buf == NULL) {
+		w->buf = malloc(SPLIT_BUFSIZE);
+		if (w->buf == NULL) {
+			perror("malloc");
+			return -1;
+		}
+	}
+	if (w->len + LINE_HEADER_MAX + len + 1 > SPLIT_BUFSIZE &&
+	    split_flush(sp, channel))
+		return -1;
+
+	p = format_header(&w->buf[w->len], ns, channel);
+	memcpy(p, data, len);
+	p[len] = '\n';
+	w->len = p + len + 1 - w->buf;
+
+	return 0;
+}
+
+static int print_line(struct print_state *st, const char *data, size_t len)
+{
+	char *p;
+
+	if (st->split != NULL) {
+		if (split_line(st->split, st->tl.ns, st->channel, data, len)) {
+			st->error = 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	p = out_reserve(LINE_HEADER_MAX + len + 1);
+	p = format_header(p, st->tl.ns, st->channel);
+	memcpy(p, data, len);
+	p[len] = '\n';
+	outlen = p + len + 1 - outbuf;
+
+	return 0;
+}
+
+/*
+ * Returns 1 once past the window to print.
+ */
+static int print_pkt(const char *data, size_t len, unsigned char channel,
+		     unsigned char master, int timestamp,
+		     struct print_state *st)
+{
+	uint64_t pkt_no, last_sync = st->tl.sync_cycles;
+	int skip, sync;
+
+	sync = stp_timeline_update(&st->tl, data, len, timestamp);
+
+	if (channel != 0xff)
+		st->channel = channel;
+	st->master = master;	/* master in effect, unlike channel */
+
+	/* Packets are numbered among the selected channels */
+	if (st->filter != NULL && !stp_filter_match(st->filter, st->channel) &&
+	    !sync)
+		return 0;
+
+	pkt_no = st->pkt_no++;
+
+	if (st->left == 0 || st->tl.cycles > st->to_cycles || st->tl.ns > st->to)
+		return 1;
+	skip = pkt_no < st->first || st->tl.cycles < st->from_cycles ||
+	       st->tl.ns < st->from;
+	if (skip)
+		return 0;
+
+	if (sync) {
+		if (st->records != NULL)
+			bin_write(st, data, len, STP_BIN_TIME_SYNC);
+		else if (print_line(st, "--- sync ---", 12))
+			return 1;
+		st->left--;
+
+		if (st->tl.drift_ns < 0)
+			fprintf(stderr, "warning: timestamp in SYNC is "
+				"lower than incremental timestamp:\n"
+				"      SYNC = %2.8f\n"
+				"should be >= %2.8f   (INCR = %llu cycles)\n",
+				st->tl.ns / 1e9,
+				(st->tl.ns - st->tl.drift_ns) / 1e9,
+				(unsigned long long) (st->tl.cycles -
+						      last_sync));
+		return 0;
+	}
+
+	if (st->records != NULL)
+		bin_write(st, data, len, 0);
+	else if (print_line(st, data, len))
+		return 1;
+	st->left--;
+
+	return 0;
+}
+
+static int print_pkts(struct stp_pkt *pkt_list, struct print_state *st)
+{
+	struct stp_pkt *pkt;
+
+	for (pkt = pkt_list; pkt != NULL; pkt = pkt->next)
+		if (print_pkt(pkt->data, pkt->len, pkt->channel, pkt->master,
+			      pkt->timestamp, st))
+			return 1;
+
+	return 0;
+}
+
+static int print_pkt_array(struct stp_pkt_array_t *arr,
+			   struct print_state *st)
+{
+	size_t k;
+
+	for (k = 0; k < arr->count; k++)
+		if (print_pkt(stp_pkt_array_data(arr, k), arr->pkts[k].len,
+			      arr->pkts[k].channel, arr->pkts[k].master,
+			      arr->pkts[k].timestamp, st))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Decodes with several threads, PARALLEL_CHUNKSIZE bytes of blocks per
+ * thread at a time.
+ */
+static int decode_parallel(char *data, size_t size, int nthreads,
+			   struct print_state *st)
+{
+	int ret = -1;
+	struct stp_blocks_t blocks = { NULL, 0, 0, 0 };
+	struct stp_blocks_t window;
+	struct stp_pkt_array_t arr;
+	struct stp_pool_t pool;
+	size_t first, last, bytes;
+
+	if (stp_find_blocks(data, size, &blocks)) {
+		fprintf(stderr, "error: couldn't split input in blocks\n");
+		goto err_free_blocks;
+	}
+	if (stp_pool_init(&pool, nthreads)) {
+		fprintf(stderr, "error: couldn't start decoding threads\n");
+		goto err_free_blocks;
+	}
+	stp_pkt_array_init(&arr);
+	arr.master = st->master;
+
+	for (first = 0; first < blocks.count; first = last) {
+		bytes = 0;
+		for (last = first; last < blocks.count &&
+		     bytes < (size_t) nthreads * PARALLEL_CHUNKSIZE; last++)
+			bytes += blocks.blocks[last].len;
+
+		window.blocks = &blocks.blocks[first];
+		window.count = last - first;
+		if (stp_pool_read_pkt_array(&pool, data, &window, &arr))
+			goto err_free_array;
+		if (print_pkt_array(&arr, st))
+			break;
+	}
+
+	ret = 0;
+
+err_free_array:
+	stp_pkt_array_free(&arr);
+	stp_pool_destroy(&pool);
+err_free_blocks:
+	stp_free_blocks(&blocks);
+	return ret;
+}
+
+/*
+ * Time between two time sync packets is interpolated linearly, so that
+ * drift of the timestamp clock is corrected.
+ */
+static void report_calib(struct stp_calib_t *cal)
+{
+	if (stp_calib_fit(cal)) {
+		fprintf(stderr, "calibration: not enough time sync packets, "
+			"using %u Hz\n", OMAP4430_FREQ);
+		return;
+	}
+
+	fprintf(stderr, "calibration: %zu time syncs, frequency %.1f Hz "
+		"(%+.1f ppm), residual %.0f ns rms, %.0f ns max\n",
+		cal->count, cal->freq,
+		(cal->freq / OMAP4430_FREQ - 1) * 1e6, cal->rms_ns,
+		cal->max_ns);
+}
+
+static void print_stats_src(const char *name, int id,
+			    const struct stp_stats_src *src)
+{
+	const struct stp_hist *h = &src->gaps;
+
+	printf("%-7s %02x %10llu %12llu %10llu %10llu %10llu %10llu %10llu\n",
+	       name, id, (unsigned long long) src->pkts,
+	       (unsigned long long) src->bytes,
+	       (unsigned long long) stp_hist_percentile(h, 0),
+	       (unsigned long long) stp_hist_percentile(h, 50),
+	       (unsigned long long) stp_hist_percentile(h, 90),
+	       (unsigned long long) stp_hist_percentile(h, 99),
+	       (unsigned long long) stp_hist_percentile(h, 100));
+}
+
+/*
+ * Prints what stp_stats_raw_etb() gathered.  Times between packets are in
+ * cycles, percentiles rounded down to 1/16.
+ */
+static void print_stats(const struct stp_stats_t *st)
+{
+	int k;
+
+	printf("blocks %zu, sync packets %zu, packets %llu, bytes %llu, "
+	       "cycles %llu, overflows %llu, errors %llu\n\n",
+	       st->blocks, st->syncs, (unsigned long long) st->pkts,
+	       (unsigned long long) st->bytes,
+	       (unsigned long long) st->cycles,
+	       (unsigned long long) st->overflows,
+	       (unsigned long long) st->errors);
+
+	printf("           %10s %12s %10s %10s %10s %10s %10s\n", "packets",
+	       "bytes", "gap min", "p50", "p90", "p99", "max");
+	for (k = 0; k < 256; k++)
+		if (st->channels[k].pkts > 0)
+			print_stats_src("channel", k, &st->channels[k]);
+	for (k = 0; k < 256; k++)
+		if (st->masters[k].pkts > 0)
+			print_stats_src("master", k, &st->masters[k]);
+}
+
+/*
+ * The index of a trace is saved next to it, in INPUTFILE.idx.
+ */
+static void index_path(char *path, size_t size, const char *trace)
+{
+	snprintf(path, size, "%s.idx", trace);
+}
+
+static int build_index(char *data, struct stat *filestat, const char *trace)
+{
+	struct stp_index_t idx;
+	char path[PATH_MAX];
+	int ret;
+
+	if (stp_index_build(data, filestat->st_size, &idx)) {
+		fprintf(stderr, "error: couldn't build index\n");
+		return -1;
+	}
+	idx.hdr.trace_mtime = filestat->st_mtime;
+
+	index_path(path, sizeof(path), trace);
+	ret = stp_index_save(&idx, path);
+	stp_index_free(&idx);
+
+	return ret;
+}
+
+/* Puts the timeline at the beginning of the block of an index entry */
+static void entry_seek(struct stp_timeline_t *tl, struct stp_index_entry *e)
+{
+	int64_t sync_ns = 0;
+
+	if (e->has_sync)
+		sync_ns = e->sync_sec * STP_NSEC_PER_SEC +
+			  e->sync_usec * 1000ULL;
+	stp_timeline_seek(tl, e->cycles, e->sync_cycles, sync_ns);
+}
+
+/*
+ * If the trace has an up-to-date index, restores the state at the last block
+ * before the first packet to print, and returns its offset.  Otherwise,
+ * decoding starts at 0.
+ */
+static off_t seek_with_index(const char *trace, struct stat *filestat,
+			     struct print_state *st)
+{
+	struct stp_index_t idx;
+	struct stp_index_entry *e;
+	struct stp_timeline_t tl = st->tl;
+	char path[PATH_MAX];
+	size_t k = 0, lo, hi, mid;
+	off_t off;
+
+	/* The index numbers the packets of all channels */
+	if (st->filter != NULL && st->first > 0)
+		return 0;
+
+	index_path(path, sizeof(path), trace);
+	if (stp_index_load(&idx, path))
+		return 0;
+
+	if (idx.hdr.trace_size != (uint64_t) filestat->st_size ||
+	    idx.hdr.trace_mtime != filestat->st_mtime || idx.hdr.count == 0) {
+		stp_index_free(&idx);
+		return 0;
+	}
+
+	if (st->first > 0)
+		k = stp_index_find_pkt(&idx, st->first);
+
+	if (st->from_cycles > 0) {
+		lo = stp_index_find_cycles(&idx, st->from_cycles);
+		if (lo > k)
+			k = lo;
+	}
+
+	if (st->from > 0) {
+		/* last block starting before the time */
+		lo = 0;
+		hi = idx.hdr.count;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			entry_seek(&tl, &idx.entries[mid]);
+			if (tl.ns < st->from)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		if (lo > k)
+			k = lo;
+	}
+
+	e = &idx.entries[k];
+	entry_seek(&st->tl, e);
+	st->channel = e->channel;
+	st->master = e->master;
+	st->pkt_no = e->pkts;
+	off = e->off;
+
+	stp_index_free(&idx);
+
+	return off;
 }
 
 int main(int argc, char **argv)
@@ -44,18 +743,55 @@ int main(int argc, char **argv)
 	int ret = EXIT_FAILURE;
 	int c;
 	int action_count = 0;
+	int action_index = 0;
+	int format_bin = 0;
+	int calibrate = 0;
+	int action_stats = 0;
+	static struct stp_stats_t stats;
+	char *split_dir = NULL;
+	int nthreads = 1;
 
 	int fd;
 	struct stat filestat;
 	void *data;
 
-	struct stp_pkt *pkt_list,
-		       *pkt;
+	struct stp_pkt *pkt_list;
+	struct stp_decoder_t decoder;
+	struct stp_arena_t arena;
+	struct print_state state = {
+		.channel = 0xff,
+		.master = 0xff,
+		.left = UINT64_MAX,
+		.to = INT64_MAX,
+		.to_cycles = UINT64_MAX,
+	};
+	struct stp_filter_t filter;
+	struct stp_calib_t calib;
+	struct split_state split;
+	off_t start = 0, off;
+	size_t chunk;
+
+	static const struct option long_options[] = {
+		{ "first", required_argument, NULL, 'n' },
+		{ "count", required_argument, NULL, OPT_COUNT },
+		{ "from", required_argument, NULL, 't' },
+		{ "to", required_argument, NULL, OPT_TO },
+		{ "format", required_argument, NULL, OPT_FORMAT },
+		{ "calibrate", no_argument, NULL, OPT_CALIBRATE },
+		{ "split-dir", required_argument, NULL, OPT_SPLIT_DIR },
+		{ "stats", no_argument, NULL, OPT_STATS },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	/*
 	 * Parse args
 	 */
-	while ((c = getopt(argc, argv, "hc")) != -1)
+	stp_filter_init(&filter);
+	stp_timeline_init(&state.tl, OMAP4430_FREQ);
+	stp_calib_init(&calib);
+
+	while ((c = getopt_long(argc, argv, "hcxj:n:t:C:", long_options,
+				NULL)) != -1)
 		switch (c) {
 		case 'h':
 			usage(argv[0]);
@@ -63,13 +799,66 @@ int main(int argc, char **argv)
 		case 'c':
 			action_count = 1;
 			break;
+		case 'x':
+			action_index = 1;
+			break;
+		case 'n':
+			state.first = strtoull(optarg, NULL, 0);
+			break;
+		case 'C':
+			if (stp_filter_parse(&filter, optarg)) {
+				fprintf(stderr, "error: invalid channel list "
+					"'%s'\n", optarg);
+				goto end;
+			}
+			state.filter = &filter;
+			break;
+		case OPT_COUNT:
+			state.left = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			if (parse_time(optarg, &state.from, &state.from_cycles)) {
+				usage(argv[0]);
+				goto end;
+			}
+			break;
+		case OPT_TO:
+			if (parse_time(optarg, &state.to, &state.to_cycles)) {
+				usage(argv[0]);
+				goto end;
+			}
+			break;
+		case OPT_FORMAT:
+			if (strcmp(optarg, "bin") == 0) {
+				format_bin = 1;
+			} else if (strcmp(optarg, "text") != 0) {
+				usage(argv[0]);
+				goto end;
+			}
+			break;
+		case OPT_CALIBRATE:
+			calibrate = 1;
+			break;
+		case OPT_SPLIT_DIR:
+			split_dir = optarg;
+			break;
+		case OPT_STATS:
+			action_stats = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				usage(argv[0]);
+				goto end;
+			}
+			break;
 		case '?':
 		default:
 			usage(argv[0]);
 			goto end;
 		}
 
-	if (optind != argc - 1) {
+	if (optind != argc - 1 || (format_bin && split_dir != NULL)) {
 		usage(argv[0]);
 		goto end;
 	}
@@ -98,53 +887,99 @@ int main(int argc, char **argv)
 		goto exit_success;
 	}
 
-	int incremental_cycles = 0;
-	double last_sync_ts = 0.0;
-	unsigned char channel = 0xff;
-
-	pkt_list = stp_read_pkts_in_raw_etb(data, filestat.st_size);
+	if (action_stats) {
+		if (stp_stats_raw_etb(data, filestat.st_size, &stats)) {
+			fprintf(stderr, "error: couldn't gather statistics\n");
+			goto err_munmap;
+		}
+		print_stats(&stats);
+		goto exit_success;
+	}
 
-	for (pkt = pkt_list; pkt != NULL; pkt = pkt->next) {
-		incremental_cycles += pkt->timestamp;
+	if (action_index) {
+		if (build_index(data, &filestat, argv[optind]))
+			goto err_munmap;
+		goto exit_success;
+	}
 
-		if (pkt->channel != 0xff)
-			channel = pkt->channel;
+	if (calibrate) {
+		if (stp_calib_scan(data, filestat.st_size, &calib))
+			goto err_munmap;
+		report_calib(&calib);
+		stp_timeline_calibrate(&state.tl, &calib);
+	}
 
-		if (pkt->len == 12 && *((uint32_t *) pkt->data) == TIME_MAGICK) {
-			struct timeval new_tv;
-			double new_ts;
+	if (state.first > 0 || state.from > 0 || state.from_cycles > 0)
+		start = seek_with_index(argv[optind], &filestat, &state);
+	filter.channel = state.channel;
 
-			new_tv = *((struct timeval *) &pkt->data[4]);
-			new_ts = timeval2double(new_tv);
-			printf("[%2.8f] [%02x] --- sync ---\n", new_ts,
-			       channel);
+	if (format_bin && bin_start(&state))
+		goto err_munmap;
+	if (split_dir != NULL) {
+		if (split_start(&split, split_dir))
+			goto err_munmap;
+		state.split = &split;
+	}
 
-			if (new_ts < last_sync_ts + incremental_cycles / OMAP4430_FREQ)
-				fprintf(stderr, "warning: timestamp in SYNC is "
-					"lower than incremental timestamp:\n"
-					"      SYNC = %2.8f\n"
-					"should be >= %2.8f   (INCR = %d cycles)\n",
-					new_ts, last_sync_ts + incremental_cycles / OMAP4430_FREQ,
-					incremental_cycles);
+	if (nthreads > 1) {
+		if (decode_parallel((char *) data + start,
+				    filestat.st_size - start, nthreads, &state))
+			goto err_munmap;
+		goto finish;
+	}
 
-			last_sync_ts = new_ts;
-			incremental_cycles = 0;
-			continue;
-		}
+	if (stp_decoder_init(&decoder)) {
+		fprintf(stderr, "error: couldn't initialize STP decoder\n");
+		goto err_munmap;
+	}
+	stp_arena_init(&arena, 0);
+	decoder.arena = &arena;
+	decoder.filter = state.filter;
+	decoder.master = state.master;
 
+	/*
+	 * Decode the file chunk by chunk, so that only the packets of the
+	 * current chunk are in memory at a time.  The same arena slabs are
+	 * reused for every chunk.
+	 */
+	for (off = start; off < filestat.st_size; off += chunk) {
+		chunk = filestat.st_size - off;
+		if (chunk > CHUNKSIZE)
+			chunk = CHUNKSIZE;
 
-		printf("[%2.8f] [%02x] ", last_sync_ts + incremental_cycles / OMAP4430_FREQ,
-		       channel);
-		fwrite(pkt->data, 1, pkt->len, stdout);
-		printf("\n");
+		pkt_list = stp_decoder_feed(&decoder, (char *) data + off,
+					    chunk);
+		if (print_pkts(pkt_list, &state))
+			goto destroy_decoder;
+		stp_arena_reset(&arena);
 	}
 
-	if (pkt_list != NULL)
-		free_stp_pkt_list(pkt_list);
+	pkt_list = stp_decoder_flush(&decoder);
+	print_pkts(pkt_list, &state);
+	if (decoder.cuts > 0)
+		fprintf(stderr, "warning: %llu bytes dropped, in %llu blocks "
+			"without a sync packet\n",
+			(unsigned long long) decoder.dropped,
+			(unsigned long long) decoder.cuts);
+
+destroy_decoder:
+	stp_decoder_destroy(&decoder);
+	stp_arena_destroy(&arena);
+
+finish:
+	if (state.error)
+		goto err_munmap;
+	if (state.records != NULL && bin_finish(&state))
+		goto err_munmap;
 
 exit_success:
 	ret = EXIT_SUCCESS;
 
+err_munmap:
+	if (state.split != NULL && split_finish(state.split))
+		ret = EXIT_FAILURE;
+	out_flush();
+	stp_calib_free(&calib);
 	munmap(data, filestat.st_size);
 err_close:
 	close(fd);